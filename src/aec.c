@@ -0,0 +1,159 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dsp.h"
+#include "aec.h"
+
+// Capture frames are filtered in blocks of this size
+#define AEC_BLOCK	256
+#define AEC_MU		0.3f
+#define AEC_EPSILON	1e-3f
+
+struct aec {
+	pthread_mutex_t lock;	// of the ring, pushed and read from different threads
+	unsigned int taps;
+	unsigned int size;	// reference ring size, power of 2
+	float *ring;		// mono reference, indexed by playback position
+	long long end;		// playback position after the newest reference frame
+	float *weights;		// oldest tap first
+	float *window;		// linear copy of the reference for one block
+};
+
+struct aec *aec_new(unsigned int taps, unsigned int rate)
+{
+	struct aec *aec;
+
+	aec=calloc(1, sizeof(*aec));
+	if(!aec)
+		return NULL;
+
+	pthread_mutex_init(&aec->lock, NULL);
+
+	// Keeps one second of reference
+	aec->taps=taps;
+	aec->size=1;
+	while(aec->size<rate)
+		aec->size<<=1;
+
+	aec->ring=calloc(aec->size, sizeof(float));
+	aec->weights=calloc(taps, sizeof(float));
+	aec->window=calloc(taps + AEC_BLOCK, sizeof(float));
+	if(!aec->ring || !aec->weights || !aec->window){
+		aec_free(aec);
+		return NULL;
+	}
+
+	return aec;
+}
+
+void aec_free(struct aec *aec)
+{
+	if(!aec)
+		return;
+	free(aec->ring);
+	free(aec->weights);
+	free(aec->window);
+	pthread_mutex_destroy(&aec->lock);
+	free(aec);
+}
+
+void aec_push_reference(struct aec *aec, long long index, const int16_t *buf,
+                        unsigned int frames, unsigned int channels)
+{
+	unsigned int i, c;
+	float sample;
+
+	pthread_mutex_lock(&aec->lock);
+
+	// The playback stream was reopened, the old reference is meaningless
+	if(index!=aec->end)
+		memset(aec->ring, 0, aec->size * sizeof(float));
+
+	for(i=0; i<frames; i++){
+		sample=0;
+		for(c=0; c<channels; c++)
+			sample+=buf[i * channels + c];
+		aec->ring[(index + i) & (aec->size - 1)]=sample / (32768.0f * channels);
+	}
+	aec->end=index + frames;
+	pthread_mutex_unlock(&aec->lock);
+}
+
+// Copies the reference for positions [first, first + count), zero where unknown
+static void aec_fill_window(struct aec *aec, long long first, unsigned int count)
+{
+	unsigned int i;
+	long long pos;
+
+	for(i=0; i<count; i++){
+		pos=first + i;
+		if(pos<0 || pos>=aec->end || pos<aec->end - aec->size)
+			aec->window[i]=0;
+		else
+			aec->window[i]=aec->ring[pos & (aec->size - 1)];
+	}
+}
+
+void aec_process(struct aec *aec, long long index, int16_t *buf,
+                 unsigned int frames, unsigned int channels)
+{
+	unsigned int block, i, c;
+	float energy, echo, error, *x;
+	int out;
+
+	while(frames){
+		block=frames<AEC_BLOCK ? frames : AEC_BLOCK;
+
+		// Only the copy of the reference holds off the playback thread
+		pthread_mutex_lock(&aec->lock);
+		aec_fill_window(aec, index - aec->taps + 1, aec->taps - 1 + block);
+		pthread_mutex_unlock(&aec->lock);
+
+		energy=dsp_dot(aec->window, aec->window, aec->taps);
+		for(i=0; i<block; i++){
+			x=aec->window + i;
+			if(i)
+				energy+=x[aec->taps - 1] * x[aec->taps - 1] - x[-1] * x[-1];
+
+			echo=dsp_dot(aec->weights, x, aec->taps);
+
+			// Adapts on the first channel and removes the estimate from all
+			error=buf[i * channels] / 32768.0f - echo;
+			if(energy>AEC_EPSILON)
+				dsp_axpy(aec->weights, AEC_MU * error / (energy + AEC_EPSILON), x, aec->taps);
+
+			for(c=0; c<channels; c++){
+				out=buf[i * channels + c] - (int)(echo * 32768.0f);
+				if(out>32767)
+					out=32767;
+				else if(out<-32768)
+					out=-32768;
+				buf[i * channels + c]=out;
+			}
+		}
+
+		buf+=block * channels;
+		index+=block;
+		frames-=block;
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+/*
+ 	Acoustic echo canceller: a normalized LMS filter fed with the frames
+ 	sent to the playback device. Reference and capture frames are addressed
+ 	by their position on the playback timeline. The reference may be pushed
+ 	from another thread than the one filtering.
+ */
+struct aec;
+
+struct aec *aec_new(unsigned int taps, unsigned int rate);
+void aec_free(struct aec *aec);
+void aec_push_reference(struct aec *aec, long long index, const int16_t *buf,
+                        unsigned int frames, unsigned int channels);
+void aec_process(struct aec *aec, long long index, int16_t *buf,
+                 unsigned int frames, unsigned int channels);
@@ -18,7 +18,12 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
 
@@ -28,11 +33,67 @@
 #include <linux/msm_audio.h>
 
 #include "utils.h"
+#include "aec.h"
+#include "eq.h"
+#include "trace.h"
+#include "dsp.h"
+#include "monitor.h"
+#include "drift.h"
+#include "preproc.h"
 
 #define ARRAY_SIZE(ary)	(sizeof(ary)/sizeof(ary[0]))
 
+/* Largest buffer accepted in timer based scheduling mode: 2s of 48KHz stereo */
+#define TSCHED_BUFFER_BYTES_MAX	(48000 * 4 * 2)
+
+/* Longest sleep of a capture paused by the record switch between checks */
+#define REC_POLL_US	50000
+
+/*
+ 	Underrun concealment: fill starts when the device holds less than the
+ 	margin, fades out and in over the fade time, and gives up after the
+ 	longest gap, leaving a real underrun.
+ */
+#define CONCEAL_MARGIN_MS	10
+#define CONCEAL_FADE_MS	20
+#define CONCEAL_MAX_MS	200
+
+/* Period auto tuning measures the first seconds of a stream */
+#define AUTOTUNE_MS	3000
+/* The period has to cover the worst gap between transfers this many times */
+#define AUTOTUNE_SAFETY	2
+
+/* Voice activity keeps the capture open this long after the last speech */
+#define VAD_HANGOVER_MS	300
+
+/*
+ 	Voice encoders of the DSP. They are configured for the full rate, so each
+ 	20ms of speech comes out as one frame of a fixed size.
+ */
+struct alsa_android_encoder {
+	const char *name;
+	const char *device;
+	unsigned int frame_bytes;
+};
+
+static const struct alsa_android_encoder encoders[] = {
+	{ "amrnb", "/dev/msm_amrnb_in", 32 },	// 12.2 kbit/s
+	{ "qcelp", "/dev/msm_qcelp_in", 35 },	// 13 kbit/s
+	{ "evrc", "/dev/msm_evrc_in", 23 },	// 8.55 kbit/s
+};
+
+#define ENCODER_FRAMES_PER_SEC	50
+#define ENCODER_SAMPLE_RATE	8000
+
+enum {
+	VAD_OFF,
+	VAD_GATE,	// silent periods are replaced by digital silence
+	VAD_SKIP	// silent periods are not delivered at all
+};
+
 typedef struct snd_pcm_alsa_android {
 	snd_pcm_ioplug_t io;
+	int fd;
 	int format;
 	int sample_rate;
 	int bytes_per_frame;
@@ -40,9 +101,111 @@ typedef struct snd_pcm_alsa_android {
 	int started;
 	unsigned int old_route;
 	snd_pcm_sframes_t hw_pointer;
+
+	/*
+	 	Timer based scheduling: the application writes into a large ring,
+	 	a feeder thread pushes it to the device and the application is woken
+	 	up by a timer programmed from the feeder position.
+	 */
+	int tsched;
+	int timer_fd;
+	char *ring;
+	snd_pcm_uframes_t boundary;
+	snd_pcm_uframes_t appl;
+	snd_pcm_uframes_t hw;
+	int feeder_running;
+	int feeder_err;
+	pthread_t feeder;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int draining;
+	int paused;		// the feeder is parked while the stream is paused
+	int feeder_busy;	// the feeder is writing to the device, out of the lock
+
+	/*
+	 	Underrun concealment on the feeder: the last 10ms written are kept,
+	 	and played mirrored with a fade out while the application is late.
+	 */
+	int conceal;
+	int16_t *conceal_hist;
+	snd_pcm_uframes_t conceal_len;
+	snd_pcm_uframes_t conceal_frames;
+	float conceal_gain;
+
+	// Resampling of the feeder against the clock of the application
+	int drift_enabled;
+	struct drift *drift;
+
+	/*
+	 	Idle suspend: after idle_max frames of digital silence, or an empty
+	 	ring for as long, the device is stopped but kept open and configured.
+	 */
+	long idle_ms;
+	snd_pcm_uframes_t idle_max;
+	snd_pcm_uframes_t idle_frames;
+	int suspended;
+
+	/*
+	 	Full duplex group: a playback and a capture instance sharing a group
+	 	name are started together and timed against CLOCK_MONOTONIC.
+	 */
+	char *duplex_group;
+	struct snd_pcm_alsa_android *duplex_next;
+	int duplex_ready;	// device open and configured, the peer may start it
+	struct timespec start_time;
+	snd_pcm_uframes_t device_frames;
+	long long round_trip_ns;
+
+	// Echo canceller on the capture side of a duplex group
+	int aec_enabled;
+	int aec_taps;
+	struct aec *aec;
+
+	// Per route equalizer on playback, processed into scratch before the write
+	struct eq *eq;
+	int16_t *scratch;
+
+	// DC removal, noise suppression and gain control of the capture
+	struct preproc *preproc;
+
+	// Capture gating by the record switch and by voice activity
+	int rec_paused;
+	int vad;
+	float vad_threshold;
+	snd_pcm_uframes_t vad_hangover;
+
+	/*
+	 	Playback writes its frames to the monitor ring, a monitor capture
+	 	reads them back instead of opening /dev/msm_pcm_in.
+	 */
+	int monitor;
+	struct monitor_ring *monitor_ring;
+	int monitor_slot;
+	unsigned long monitor_pos;
+
+	/*
+	 	Encoded capture: the DSP encodes the voice and the stream carries
+	 	its frames as bytes, one ALSA frame per encoded byte.
+	 */
+	const struct alsa_android_encoder *encoder;
+	char *encoder_device;
+
+	// Slot in the stream registry holding the volume and mute of this PCM
+	int stream_slot;
+
+	/*
+	 	Period auto tuning: the longest time the application took between
+	 	two transfers decides the smallest safe period of later opens.
+	 */
+	int autotune;
+	int autotune_done;
+	struct timespec autotune_last;
+	long long autotune_gap_max;
+	snd_pcm_uframes_t autotune_frames;
 } snd_pcm_alsa_android_t;
 
-static int alsa_android_close(snd_pcm_ioplug_t * io);
+static pthread_mutex_t duplex_lock = PTHREAD_MUTEX_INITIALIZER;
+static snd_pcm_alsa_android_t *duplex_list;
 
 static int do_route_audio_rpc (uint32_t device, int ear_mute, int mic_mute)
 {
@@ -51,7 +214,7 @@ static int do_route_audio_rpc (uint32_t device, int ear_mute, int mic_mute)
 
 	int fd;
 
-	fd = open ("/dev/msm_snd", O_RDWR);
+	fd = snd_control_open ();
 	if (fd < 0)
 	{
 		perror ("Can not open snd device");
@@ -63,17 +226,39 @@ static int do_route_audio_rpc (uint32_t device, int ear_mute, int mic_mute)
 	args.ear_mute = ear_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 	args.mic_mute = mic_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 
-	if (ioctl (fd, SND_SET_DEVICE, &args) < 0)
+	TRACE_BEGIN(t);
+	int ret = ioctl (fd, SND_SET_DEVICE, &args);
+	TRACE_END(t, "SND_SET_DEVICE", device);
+	if (ret < 0)
 	{
 		perror ("snd_set_device error.");
-		close (fd);
 		return -1;
 	}
 
-	close (fd);
 	return 0;
 }
 
+static void alsa_android_close_device(snd_pcm_alsa_android_t *alsa_android)
+{
+	// The duplex peer drives this device under the lock
+	if(alsa_android->duplex_group)
+		pthread_mutex_lock(&duplex_lock);
+	alsa_android->duplex_ready=0;
+	if(alsa_android->fd>-1)
+		close(alsa_android->fd);
+	alsa_android->fd=-1;
+	if(alsa_android->duplex_group)
+		pthread_mutex_unlock(&duplex_lock);
+	if(!alsa_android->tsched)
+		alsa_android->io.poll_fd=-1;
+
+	alsa_android->started=0;
+	alsa_android->suspended=0;
+	alsa_android->idle_frames=0;
+	alsa_android->rec_paused=0;
+	alsa_android->device_frames=0;
+}
+
 static int alsa_android_prepare1(snd_pcm_ioplug_t * io)
 {
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
@@ -83,30 +268,38 @@ static int alsa_android_prepare1(snd_pcm_ioplug_t * io)
 	
 	shared_props_get_route_id(&route);
 
-	if(alsa_android->io.poll_fd!=-1){
+	if(alsa_android->fd!=-1){
 		if(route!=alsa_android->old_route){
 			//printf("Routing changed from %ud to %ud\n",alsa_android->old_route,route);
 			// reinitializes if audio routing changes
-			alsa_android_close(io);
+			TRACE_MARK("route_change", route);
+			alsa_android_close_device(alsa_android);
 		}else
 			return 0;
 	}
 	alsa_android->old_route=route;
 
-	switch(alsa_android->io.poll_events){
-		case POLLOUT:
-			alsa_android->io.poll_fd =  open ("/dev/msm_pcm_out", O_RDWR);
+	TRACE_BEGIN(t_open);
+	switch(io->stream){
+		case SND_PCM_STREAM_PLAYBACK:
+			alsa_android->fd =  open ("/dev/msm_pcm_out", O_RDWR);
 			break;
 		default:
-			alsa_android->io.poll_fd = open ("/dev/msm_pcm_in", O_RDWR);
+			if(alsa_android->encoder)
+				alsa_android->fd = open (alsa_android->encoder_device, O_RDWR);
+			else
+				alsa_android->fd = open ("/dev/msm_pcm_in", O_RDWR);
 	}
+	TRACE_END(t_open, "device_open", io->stream);
 
-	if(alsa_android->io.poll_fd==-1){
+	if(alsa_android->fd==-1){
 		SNDERR("PCM file open failed: %s", strerror(errno));
 		return errno;
 	}
 	
-	ret=ioctl (alsa_android->io.poll_fd, AUDIO_GET_CONFIG, &config);
+	TRACE_BEGIN(t_get);
+	ret=ioctl (alsa_android->fd, AUDIO_GET_CONFIG, &config);
+	TRACE_END(t_get, "AUDIO_GET_CONFIG", io->stream);
 	if(ret==-1){
 		SNDERR("AUDIO_GET_CONFIG ioctl failed: %s", strerror(errno));
 		return errno;
@@ -114,47 +307,945 @@ static int alsa_android_prepare1(snd_pcm_ioplug_t * io)
 
 	config.channel_count = io->channels;
 	config.sample_rate = alsa_android->sample_rate;
+	if(alsa_android->encoder)
+		config.sample_rate = ENCODER_SAMPLE_RATE;
 	alsa_android->buffer_size=config.buffer_size;
 
+	if(io->stream==SND_PCM_STREAM_PLAYBACK){
+		int16_t *scratch=realloc(alsa_android->scratch, config.buffer_size);
+		if(!scratch)
+			return ENOMEM;
+		alsa_android->scratch=scratch;
+	}
+
 	//printf("config.channel_count=%d, config.sample_rate=%d\n",config.channel_count,config.sample_rate);
 
-	ret=ioctl (alsa_android->io.poll_fd, AUDIO_SET_CONFIG, &config);
-	if(ret==-1){
-		SNDERR("AUDIO_SET_CONFIG ioctl failed: %s", strerror(errno));
-		return errno;
+	TRACE_BEGIN(t_set);
+	ret=ioctl (alsa_android->fd, AUDIO_SET_CONFIG, &config);
+	TRACE_END(t_set, "AUDIO_SET_CONFIG", config.sample_rate);
+	if(ret==-1){
+		SNDERR("AUDIO_SET_CONFIG ioctl failed: %s", strerror(errno));
+		return errno;
+	}
+
+	// In tsched mode the application polls the timer, not the device
+	if(!alsa_android->tsched){
+		alsa_android->io.poll_fd=alsa_android->fd;
+		snd_pcm_ioplug_reinit_status(io);
+	}
+
+	if(alsa_android->duplex_group){
+		pthread_mutex_lock(&duplex_lock);
+		alsa_android->duplex_ready=1;
+		pthread_mutex_unlock(&duplex_lock);
+	}
+	return 0;
+}
+
+static int alsa_android_start_device(snd_pcm_alsa_android_t *alsa_android)
+{
+	TRACE_BEGIN(t);
+	int ret=ioctl(alsa_android->fd, AUDIO_START, 0);
+	TRACE_END(t, "AUDIO_START", alsa_android->io.stream);
+	if(ret)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &alsa_android->start_time);
+	alsa_android->started++;
+	return 0;
+}
+
+// Must be called with duplex_lock held
+static snd_pcm_alsa_android_t *alsa_android_duplex_peer(snd_pcm_alsa_android_t *alsa_android)
+{
+	snd_pcm_alsa_android_t *peer;
+
+	for(peer=duplex_list; peer; peer=peer->duplex_next){
+		if(peer!=alsa_android && peer->io.stream!=alsa_android->io.stream &&
+		   !strcmp(peer->duplex_group, alsa_android->duplex_group))
+			return peer;
+	}
+	return NULL;
+}
+
+/*
+ 	Starts the device together with its duplex peer, if the peer finished
+ 	its prepare and is not running yet, so both share the same start time.
+ 	The peer may start this stream meanwhile, so started is checked again
+ 	under the lock. Returns 1 when the device was started by this call.
+ */
+static int alsa_android_duplex_start(snd_pcm_alsa_android_t *alsa_android)
+{
+	snd_pcm_alsa_android_t *peer;
+	int ret=0;
+
+	pthread_mutex_lock(&duplex_lock);
+	if(!alsa_android->started && !alsa_android_start_device(alsa_android)){
+		ret=1;
+		peer=alsa_android_duplex_peer(alsa_android);
+		if(peer && peer->duplex_ready && !peer->started &&
+		   !alsa_android_start_device(peer)){
+			// Both streams run on the clock of the first start
+			peer->start_time=alsa_android->start_time;
+		}
+	}
+	pthread_mutex_unlock(&duplex_lock);
+
+	return ret;
+}
+
+/*
+ 	Accounts frames moved to or from the device and updates the round trip
+ 	latency of the duplex group: how far the playback timeline runs ahead
+ 	of the capture timeline. The echo canceller taps the played frames here
+ 	and filters the captured ones.
+ */
+static void alsa_android_duplex_update(snd_pcm_alsa_android_t *alsa_android, char *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_alsa_android_t *peer, *play, *capt;
+	long long play_ns, capt_ns, rt, capt_first;
+	struct aec *aec;
+
+	pthread_mutex_lock(&duplex_lock);
+	peer=alsa_android_duplex_peer(alsa_android);
+
+	if(alsa_android->io.stream==SND_PCM_STREAM_PLAYBACK && peer && peer->aec)
+		aec_push_reference(peer->aec, alsa_android->device_frames, (int16_t *)buf,
+		                   frames, alsa_android->io.channels);
+
+	capt_first=alsa_android->device_frames;
+	alsa_android->device_frames+=frames;
+
+	if(!alsa_android->started || !peer || !peer->started){
+		pthread_mutex_unlock(&duplex_lock);
+		return;
+	}
+
+	play=alsa_android->io.stream==SND_PCM_STREAM_PLAYBACK ? alsa_android : peer;
+	capt=alsa_android->io.stream==SND_PCM_STREAM_PLAYBACK ? peer : alsa_android;
+
+	play_ns=play->start_time.tv_sec * 1000000000LL + play->start_time.tv_nsec +
+	        (long long)play->device_frames * 1000000000LL / play->sample_rate;
+	capt_ns=capt->start_time.tv_sec * 1000000000LL + capt->start_time.tv_nsec +
+	        (long long)capt->device_frames * 1000000000LL / capt->sample_rate;
+	rt=play_ns - capt_ns;
+	if(rt<0)
+		rt=0;
+
+	// Smoothed, so the per transfer jitter does not show
+	if(alsa_android->round_trip_ns)
+		rt=(alsa_android->round_trip_ns * 7 + rt) / 8;
+	alsa_android->round_trip_ns=rt;
+	peer->round_trip_ns=rt;
+
+	// Position of the first captured frame on the playback timeline
+	aec=NULL;
+	if(alsa_android->aec && play->sample_rate==capt->sample_rate){
+		aec=alsa_android->aec;
+		capt_first=(capt->start_time.tv_sec - play->start_time.tv_sec) * (long long)capt->sample_rate +
+		           (capt->start_time.tv_nsec - play->start_time.tv_nsec) * (long long)capt->sample_rate / 1000000000LL +
+		           capt_first;
+	}
+	pthread_mutex_unlock(&duplex_lock);
+
+	/*
+	 	Filtered without the group lock, the canceller is replaced and
+	 	freed only by this stream, and locks its reference ring itself.
+	 */
+	if(aec)
+		aec_process(aec, capt_first, (int16_t *)buf, frames, alsa_android->io.channels);
+
+	shared_props_set_duplex_latency(rt / 1000);
+}
+
+static int alsa_android_prepare2(snd_pcm_ioplug_t * io)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+
+	if(alsa_android->started)
+		return 0;
+
+	if(alsa_android->duplex_group){
+		if(!alsa_android_duplex_start(alsa_android))
+			return 0;
+	}else
+		alsa_android_start_device(alsa_android);
+
+	if(alsa_android->started){
+		long volume=3;
+		shared_props_get_volume(&volume);
+		set_volume_rpc(volume);
+	}
+	
+	return 0;
+}
+
+// Distance from position b forward to position a, both wrapping at boundary
+static snd_pcm_uframes_t alsa_android_tsched_distance(snd_pcm_alsa_android_t *alsa_android,
+                                                      snd_pcm_uframes_t a, snd_pcm_uframes_t b)
+{
+	if(a>=b)
+		return a - b;
+	return alsa_android->boundary - b + a;
+}
+
+/*
+ 	Number of frames queued in the ring and not yet handed to the device.
+ 	Must be called with the lock held.
+ */
+static snd_pcm_uframes_t alsa_android_tsched_queued(snd_pcm_alsa_android_t *alsa_android)
+{
+	return alsa_android_tsched_distance(alsa_android, alsa_android->appl, alsa_android->hw);
+}
+
+/*
+ 	Follows the application pointer after snd_pcm_rewind() or
+ 	snd_pcm_forward(). Forwarded frames are silenced, so no stale audio left
+ 	in the ring is played. A rewind can not go behind the frames the feeder
+ 	already took. Must be called with the lock held.
+ */
+static void alsa_android_tsched_sync(snd_pcm_alsa_android_t *alsa_android)
+{
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	snd_pcm_uframes_t target=io->appl_ptr, moved, offset, cont;
+
+	moved=alsa_android_tsched_distance(alsa_android, target, alsa_android->appl);
+	if(!moved)
+		return;
+
+	if(moved<=io->buffer_size){
+		offset=alsa_android->appl % io->buffer_size;
+		cont=io->buffer_size - offset;
+		if(cont>moved)
+			cont=moved;
+		memset(alsa_android->ring + offset * alsa_android->bytes_per_frame, 0,
+		       cont * alsa_android->bytes_per_frame);
+		memset(alsa_android->ring, 0, (moved - cont) * alsa_android->bytes_per_frame);
+	}else if(alsa_android_tsched_distance(alsa_android, target, alsa_android->hw)>io->buffer_size){
+		target=alsa_android->hw;
+	}
+	alsa_android->appl=target;
+}
+
+/*
+ 	Programs the wakeup timer for the moment the device position frees one
+ 	period in the ring. Must be called with the lock held.
+ */
+static void alsa_android_tsched_arm(snd_pcm_alsa_android_t *alsa_android)
+{
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	snd_pcm_uframes_t queued, threshold, frames=0;
+	struct itimerspec its;
+	long long ns;
+
+	queued=alsa_android_tsched_queued(alsa_android);
+	threshold=io->buffer_size - io->period_size;
+	if(queued>threshold)
+		frames=queued - threshold;
+
+	// A zero value disarms the timer, so wake up immediately instead
+	ns=(long long)frames * 1000000000LL / io->rate;
+	if(ns==0)
+		ns=1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec=ns / 1000000000LL;
+	its.it_value.tv_nsec=ns % 1000000000LL;
+	timerfd_settime(alsa_android->timer_fd, 0, &its, NULL);
+}
+
+// Software gain of the registry slot, 1 when the stream is not registered
+static float alsa_android_stream_gain(snd_pcm_alsa_android_t *alsa_android)
+{
+	long volume, mute;
+
+	if(alsa_android->stream_slot<0 ||
+	   shared_stream_get_gain(alsa_android->stream_slot, &volume, &mute))
+		return 1.0f;
+	if(mute)
+		return 0.0f;
+	return volume / 100.0f;
+}
+
+// Publishes the peak and RMS level of the frames going through the stream
+static void alsa_android_meter(snd_pcm_alsa_android_t *alsa_android, int peak, float mean_square)
+{
+	shared_props_set_levels(alsa_android->io.stream, peak, (long)(sqrtf(mean_square) * 32767));
+}
+
+static void alsa_android_suspend(snd_pcm_alsa_android_t *alsa_android)
+{
+	TRACE_BEGIN(t);
+	ioctl(alsa_android->fd, AUDIO_STOP, 0);
+	TRACE_END(t, "idle_suspend", alsa_android->idle_frames);
+	alsa_android->suspended=1;
+}
+
+/*
+ 	Tracks digital silence on a started playback, from the peak of the
+ 	buffer. Returns 1 when the buffer needs no write because the device is
+ 	suspended, resumes the device on the first buffer that is not silent.
+ 	A failed resume leaves the device suspended and returns the error.
+ */
+static int alsa_android_idle(snd_pcm_alsa_android_t *alsa_android, int peak, snd_pcm_uframes_t frames)
+{
+	int ret;
+
+	if(peak){
+		alsa_android->idle_frames=0;
+		if(alsa_android->suspended){
+			TRACE_BEGIN(t);
+			ret=ioctl(alsa_android->fd, AUDIO_START, 0);
+			TRACE_END(t, "idle_resume", frames);
+			if(ret)
+				return -errno;
+			alsa_android->suspended=0;
+		}
+		return 0;
+	}
+
+	alsa_android->idle_frames+=frames;
+	if(alsa_android->started && !alsa_android->suspended && alsa_android->idle_frames>=alsa_android->idle_max)
+		alsa_android_suspend(alsa_android);
+	return alsa_android->suspended;
+}
+
+static int alsa_android_write_device(snd_pcm_ioplug_t * io, const char *buf, int buf_size)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	ssize_t result;
+	int err, peak;
+	float gain, mean_square;
+
+	err=alsa_android_prepare1(io);
+	if(err)
+		return -err;
+
+	if (buf_size > alsa_android->buffer_size)
+		buf_size = alsa_android->buffer_size;
+
+	// Measured once for the idle check and the meters, before the EQ
+	dsp_levels_s16((const int16_t *)buf, buf_size / 2, &peak, &mean_square);
+
+	/*
+	 	Silence is dropped while suspended, paced at the stream rate in
+	 	place of the blocking write.
+	 */
+	if(alsa_android->idle_max){
+		err=alsa_android_idle(alsa_android, peak, buf_size / alsa_android->bytes_per_frame);
+		if(err<0)
+			return err;
+		if(err){
+			alsa_android_meter(alsa_android, 0, 0);
+			usleep((long long)buf_size / alsa_android->bytes_per_frame * 1000000 / alsa_android->sample_rate);
+			return buf_size;
+		}
+	}
+
+	// The preset follows the route the device was opened for
+	if(alsa_android->eq){
+		eq_select_route(alsa_android->eq, alsa_android->old_route);
+		if(eq_active(alsa_android->eq)){
+			eq_process(alsa_android->eq, (const int16_t *)buf, alsa_android->scratch,
+			           buf_size / alsa_android->bytes_per_frame);
+			buf=(const char *)alsa_android->scratch;
+		}
+	}
+
+	gain=alsa_android_stream_gain(alsa_android);
+	if(gain!=1.0f){
+		dsp_gain_s16((const int16_t *)buf, alsa_android->scratch, buf_size / 2, gain);
+		buf=(const char *)alsa_android->scratch;
+	}
+
+	TRACE_BEGIN(t);
+	result = write (alsa_android->fd, buf, buf_size);
+	TRACE_END(t, "write", buf_size);
+	if(result<0)
+		return -errno;
+
+	alsa_android_meter(alsa_android, (int)(peak * gain), mean_square * gain * gain);
+	monitor_write(alsa_android->monitor_ring, (const int16_t *)buf, result / alsa_android->bytes_per_frame,
+	              io->channels, io->rate);
+
+	// The buffer is filled before calling start
+	err=alsa_android_prepare2(io);
+	if(err)
+		return -err;
+
+	if(alsa_android->duplex_group)
+		alsa_android_duplex_update(alsa_android, (char *)buf, result / alsa_android->bytes_per_frame);
+	else
+		alsa_android->device_frames+=result / alsa_android->bytes_per_frame;
+
+	return result;
+}
+
+/*
+ 	Holds the capture while the record switch is off. The device is stopped
+ 	but stays open and configured, so resuming is a single AUDIO_START.
+ */
+static int alsa_android_capture_gate(snd_pcm_ioplug_t * io)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	long rec=1;
+	int changes;
+
+	changes=shared_props_changes();
+	shared_props_get_rec_flag(&rec);
+	while(!rec){
+		if(alsa_android->started && !alsa_android->rec_paused){
+			ioctl(alsa_android->fd, AUDIO_STOP, 0);
+			alsa_android->rec_paused=1;
+			TRACE_MARK("rec_pause", 0);
+		}
+		if(io->nonblock)
+			return -EAGAIN;
+		// Woken by the switch itself, the timeout is only a safety net
+		shared_props_wait_change(changes, REC_POLL_US);
+		changes=shared_props_changes();
+		shared_props_get_rec_flag(&rec);
+	}
+
+	if(alsa_android->rec_paused){
+		alsa_android->rec_paused=0;
+		TRACE_MARK("rec_resume", 0);
+		if(ioctl(alsa_android->fd, AUDIO_START, 0))
+			return -errno;
+	}
+	return 0;
+}
+
+// Returns non zero if the frames are part of a silent period
+static int alsa_android_vad_silent(snd_pcm_alsa_android_t *alsa_android, const char *buf, snd_pcm_uframes_t frames)
+{
+	if(dsp_mean_square_s16((const int16_t *)buf, frames * alsa_android->io.channels)>=alsa_android->vad_threshold){
+		alsa_android->vad_hangover=alsa_android->sample_rate * VAD_HANGOVER_MS / 1000;
+		return 0;
+	}
+	if(alsa_android->vad_hangover>frames){
+		alsa_android->vad_hangover-=frames;
+		return 0;
+	}
+	alsa_android->vad_hangover=0;
+	return 1;
+}
+
+static int alsa_android_read_device(snd_pcm_ioplug_t * io, char *buf, int buf_size)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	ssize_t result;
+	int err;
+	float gain;
+
+	do{
+		err=alsa_android_capture_gate(io);
+		if(err)
+			return err;
+
+		/*
+		 	Initializes the fd and stream parameters and
+		 	call start before reading
+		 */
+		err=alsa_android_prepare1(io);
+		if(err)
+			return -err;
+		err=alsa_android_prepare2(io);
+		if(err)
+			return -err;
+
+		if (buf_size > alsa_android->buffer_size)
+			buf_size = alsa_android->buffer_size;
+
+		// The encoder hands out whole frames only
+		if(alsa_android->encoder){
+			buf_size -= buf_size % alsa_android->encoder->frame_bytes;
+			if(!buf_size)
+				return -EINVAL;
+		}
+
+		TRACE_BEGIN(t);
+		result = read (alsa_android->fd, buf, buf_size);
+		TRACE_END(t, "read", buf_size);
+		if(result<0)
+			return -errno;
+
+		// Encoded frames carry no samples to measure
+		if(alsa_android->encoder)
+			break;
+
+		if(result>0 && alsa_android->duplex_group)
+			alsa_android_duplex_update(alsa_android, buf, result / alsa_android->bytes_per_frame);
+
+		// After the echo canceller, which needs the capture linear
+		if(result>0 && alsa_android->preproc)
+			preproc_process(alsa_android->preproc, (int16_t *)buf, result / alsa_android->bytes_per_frame);
+
+		if(result>0){
+			int peak;
+			float mean_square;
+
+			dsp_levels_s16((const int16_t *)buf, result / 2, &peak, &mean_square);
+			alsa_android_meter(alsa_android, peak, mean_square);
+		}
+
+		if(result<=0 || alsa_android->vad==VAD_OFF ||
+		   !alsa_android_vad_silent(alsa_android, buf, result / alsa_android->bytes_per_frame))
+			break;
+
+		if(alsa_android->vad==VAD_GATE){
+			memset(buf, 0, result);
+			break;
+		}
+
+		// Skipped periods are not returned, the reader keeps sleeping
+		TRACE_MARK("vad_skip", result);
+		if(io->nonblock)
+			return -EAGAIN;
+	}while(1);
+
+	gain=alsa_android_stream_gain(alsa_android);
+	if(result>0 && gain!=1.0f && !alsa_android->encoder)
+		dsp_gain_s16((const int16_t *)buf, (int16_t *)buf, result / 2, gain);
+
+	return result;
+}
+
+/*
+ 	Frames written to the device and not played yet, estimated from the
+ 	start time. After a real underrun the estimate is moved to the time the
+ 	device runs again.
+ */
+static long long alsa_android_device_queued(snd_pcm_alsa_android_t *alsa_android)
+{
+	struct timespec now;
+	long long elapsed, queued;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed=(now.tv_sec - alsa_android->start_time.tv_sec) * 1000000000LL +
+	        now.tv_nsec - alsa_android->start_time.tv_nsec;
+	queued=(long long)alsa_android->device_frames - elapsed * alsa_android->sample_rate / 1000000000LL;
+	if(queued<0){
+		elapsed=(long long)alsa_android->device_frames * 1000000000LL / alsa_android->sample_rate;
+		now.tv_sec-=elapsed / 1000000000LL;
+		now.tv_nsec-=elapsed % 1000000000LL;
+		if(now.tv_nsec<0){
+			now.tv_nsec+=1000000000LL;
+			now.tv_sec--;
+		}
+		alsa_android->start_time=now;
+		queued=0;
+	}
+	return queued;
+}
+
+// Keeps the last frames handed to the device as the source of concealment
+static void alsa_android_conceal_keep(snd_pcm_alsa_android_t *alsa_android, const char *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t len=alsa_android->conceal_len;
+	int bpf=alsa_android->bytes_per_frame;
+
+	if(frames>=len){
+		memcpy(alsa_android->conceal_hist, buf + (frames - len) * bpf, len * bpf);
+	}else{
+		memmove(alsa_android->conceal_hist, (char *)alsa_android->conceal_hist + frames * bpf, (len - frames) * bpf);
+		memcpy((char *)alsa_android->conceal_hist + (len - frames) * bpf, buf, frames * bpf);
+	}
+}
+
+/*
+ 	Writes frames extrapolated from the history while the application is
+ 	late. The history is played backwards from its end and then forwards
+ 	again, so the waveform has no step at the joins, under a fade out.
+ */
+static int alsa_android_conceal_write(snd_pcm_alsa_android_t *alsa_android, char *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	snd_pcm_uframes_t len=alsa_android->conceal_len, i, pos, src;
+	int16_t *out=(int16_t *)buf;
+	unsigned int c;
+
+	for(i=0; i<frames; i++){
+		pos=(alsa_android->conceal_frames + i) % (2 * len);
+		src=pos<len ? len - 1 - pos : pos - len;
+		for(c=0; c<io->channels; c++)
+			out[i * io->channels + c]=alsa_android->conceal_hist[src * io->channels + c];
+	}
+	alsa_android->conceal_gain=dsp_ramp_s16(out, frames, io->channels, alsa_android->conceal_gain,
+	                                        -1000.0f / (alsa_android->sample_rate * CONCEAL_FADE_MS));
+	alsa_android->conceal_frames+=frames;
+	TRACE_MARK("conceal", frames);
+
+	return alsa_android_write_device(io, buf, frames * alsa_android->bytes_per_frame);
+}
+
+/*
+ 	Waits for frames in the ring. With idle suspend, a ring that stays empty
+ 	for the idle time suspends the device. Must be called with the lock held.
+ */
+static void alsa_android_idle_wait(snd_pcm_alsa_android_t *alsa_android)
+{
+	struct timespec deadline;
+	long long wait_ns;
+
+	if(!alsa_android->idle_max || !alsa_android->started || alsa_android->suspended){
+		pthread_cond_wait(&alsa_android->cond, &alsa_android->lock);
+		return;
+	}
+
+	wait_ns=(long long)alsa_android->idle_max * 1000000000LL / alsa_android->sample_rate;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec+=wait_ns / 1000000000LL;
+	deadline.tv_nsec+=wait_ns % 1000000000LL;
+	if(deadline.tv_nsec>=1000000000L){
+		deadline.tv_nsec-=1000000000L;
+		deadline.tv_sec++;
+	}
+	if(pthread_cond_timedwait(&alsa_android->cond, &alsa_android->lock, &deadline)==ETIMEDOUT &&
+	   !alsa_android_tsched_queued(alsa_android) && alsa_android->feeder_running)
+		alsa_android_suspend(alsa_android);
+}
+
+/*
+ 	Called by the feeder with the lock held when the ring is empty. Waits
+ 	until the device is about to starve and then fills the gap. Returns a
+ 	negative error of the write, or 0.
+ */
+static int alsa_android_conceal_wait(snd_pcm_alsa_android_t *alsa_android, char *buf)
+{
+	snd_pcm_uframes_t margin=alsa_android->sample_rate * CONCEAL_MARGIN_MS / 1000;
+	struct timespec deadline;
+	long long queued, wait_ns;
+	int ret;
+
+	// The fill goes through the feeder buffer of one device chunk
+	if(margin>(snd_pcm_uframes_t)(alsa_android->buffer_size / alsa_android->bytes_per_frame))
+		margin=alsa_android->buffer_size / alsa_android->bytes_per_frame;
+
+	if(!alsa_android->conceal || !alsa_android->started || alsa_android->draining ||
+	   alsa_android->io.state==SND_PCM_STATE_PAUSED ||
+	   alsa_android->conceal_frames>=alsa_android->sample_rate * CONCEAL_MAX_MS / 1000){
+		alsa_android_idle_wait(alsa_android);
+		return 0;
+	}
+
+	queued=alsa_android_device_queued(alsa_android);
+	if(queued>(long long)margin){
+		wait_ns=(queued - margin) * 1000000000LL / alsa_android->sample_rate;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec+=wait_ns / 1000000000LL;
+		deadline.tv_nsec+=wait_ns % 1000000000LL;
+		if(deadline.tv_nsec>=1000000000L){
+			deadline.tv_nsec-=1000000000L;
+			deadline.tv_sec++;
+		}
+		pthread_cond_timedwait(&alsa_android->cond, &alsa_android->lock, &deadline);
+		return 0;
+	}
+
+	alsa_android->feeder_busy=1;
+	pthread_mutex_unlock(&alsa_android->lock);
+	ret=alsa_android_conceal_write(alsa_android, buf, margin);
+	pthread_mutex_lock(&alsa_android->lock);
+	alsa_android->feeder_busy=0;
+	pthread_cond_broadcast(&alsa_android->cond);
+	return ret<0 ? ret : 0;
+}
+
+/*
+ 	Frames written to the device and not consumed by the DSP yet, from the
+ 	byte count it reports. 0 when the driver does not report it.
+ */
+static long alsa_android_device_pending(snd_pcm_alsa_android_t *alsa_android)
+{
+	struct msm_audio_stats stats;
+	long pending;
+
+	if(ioctl(alsa_android->fd, AUDIO_GET_STATS, &stats))
+		return 0;
+	pending=(long)alsa_android->device_frames - (long)(stats.byte_count / alsa_android->bytes_per_frame);
+	return pending>0 ? pending : 0;
+}
+
+// Moves the frames queued in the ring to the device. It is running in a seperate thread
+static void *alsa_android_feeder(void *arg)
+{
+	snd_pcm_alsa_android_t *alsa_android = arg;
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	snd_pcm_uframes_t chunk, frames, offset, cont, fill=0;
+	char *buf, *out=NULL;
+	int ret;
+
+	chunk=alsa_android->buffer_size / alsa_android->bytes_per_frame;
+	buf=malloc(alsa_android->buffer_size);
+	if(buf && alsa_android->drift){
+		out=malloc(alsa_android->buffer_size);
+		if(!out){
+			free(buf);
+			buf=NULL;
+		}
+	}
+	if(!buf){
+		pthread_mutex_lock(&alsa_android->lock);
+		alsa_android->feeder_err=-ENOMEM;
+		alsa_android->feeder_running=0;
+		pthread_cond_broadcast(&alsa_android->cond);
+		pthread_mutex_unlock(&alsa_android->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&alsa_android->lock);
+	while(alsa_android->feeder_running){
+		// Writes to the stopped device of a paused stream would fail
+		if(alsa_android->paused){
+			pthread_cond_wait(&alsa_android->cond, &alsa_android->lock);
+			continue;
+		}
+		frames=alsa_android_tsched_queued(alsa_android);
+		if(frames==0){
+			ret=alsa_android_conceal_wait(alsa_android, buf);
+			if(ret<0){
+				SNDERR("PCM write failed: %s", strerror(-ret));
+				alsa_android->feeder_err=ret;
+				alsa_android->feeder_running=0;
+				pthread_cond_broadcast(&alsa_android->cond);
+			}
+			continue;
+		}
+		fill=frames;
+		if(frames>chunk)
+			frames=chunk;
+		// Room for the resampler to produce more frames than it takes
+		if(alsa_android->drift && frames>chunk - chunk / 128)
+			frames=chunk - chunk / 128;
+
+		// Frames leave the ring before the write, so they can no longer be rewritten
+		offset=alsa_android->hw % io->buffer_size;
+		cont=io->buffer_size - offset;
+		if(cont>frames)
+			cont=frames;
+		memcpy(buf, alsa_android->ring + offset * alsa_android->bytes_per_frame,
+		       cont * alsa_android->bytes_per_frame);
+		if(frames>cont)
+			memcpy(buf + cont * alsa_android->bytes_per_frame, alsa_android->ring,
+			       (frames - cont) * alsa_android->bytes_per_frame);
+
+		alsa_android->hw+=frames;
+		if(alsa_android->hw>=alsa_android->boundary)
+			alsa_android->hw-=alsa_android->boundary;
+		alsa_android->feeder_busy=1;
+		pthread_cond_broadcast(&alsa_android->cond);
+		pthread_mutex_unlock(&alsa_android->lock);
+
+		// Fades back in after a concealed gap
+		if(alsa_android->conceal){
+			if(alsa_android->conceal_gain<1.0f)
+				alsa_android->conceal_gain=dsp_ramp_s16((int16_t *)buf, frames, io->channels, alsa_android->conceal_gain,
+				                                        1000.0f / (alsa_android->sample_rate * CONCEAL_FADE_MS));
+			alsa_android->conceal_frames=0;
+			alsa_android_conceal_keep(alsa_android, buf, frames);
+		}
+
+		if(alsa_android->drift && alsa_android->started){
+			/*
+			 	The application clock fills the ring, the device clock
+			 	drains it and what the device holds: the resampler
+			 	keeps the sum where it settled.
+			 */
+			drift_update(alsa_android->drift, fill + alsa_android_device_pending(alsa_android), frames);
+			TRACE_MARK("drift_ppm", drift_ppm(alsa_android->drift));
+			frames=drift_process(alsa_android->drift, (const int16_t *)buf, frames, (int16_t *)out, chunk);
+			ret=alsa_android_write_device(io, out, frames * alsa_android->bytes_per_frame);
+		}else
+			ret=alsa_android_write_device(io, buf, frames * alsa_android->bytes_per_frame);
+
+		pthread_mutex_lock(&alsa_android->lock);
+		alsa_android->feeder_busy=0;
+		pthread_cond_broadcast(&alsa_android->cond);
+		if(ret<0){
+			SNDERR("PCM write failed: %s", strerror(-ret));
+			alsa_android->feeder_err=ret;
+			alsa_android->feeder_running=0;
+			pthread_cond_broadcast(&alsa_android->cond);
+		}
+	}
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	free(out);
+	free(buf);
+	return NULL;
+}
+
+static void alsa_android_feeder_stop(snd_pcm_alsa_android_t *alsa_android)
+{
+	pthread_mutex_lock(&alsa_android->lock);
+	if(!alsa_android->feeder_running){
+		pthread_mutex_unlock(&alsa_android->lock);
+		return;
+	}
+	alsa_android->feeder_running=0;
+	pthread_cond_broadcast(&alsa_android->cond);
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	pthread_join(alsa_android->feeder, NULL);
+}
+
+// Wakes monitor readers polling the timer once per period
+static void alsa_android_monitor_arm(snd_pcm_alsa_android_t *alsa_android, int enable)
+{
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	struct itimerspec its;
+	long long ns=0;
+
+	if(enable)
+		ns=(long long)io->period_size * 1000000000LL / io->rate;
+
+	its.it_value.tv_sec=ns / 1000000000LL;
+	its.it_value.tv_nsec=ns % 1000000000LL;
+	its.it_interval=its.it_value;
+	timerfd_settime(alsa_android->timer_fd, 0, &its, NULL);
+}
+
+static int alsa_android_start(snd_pcm_ioplug_t * io)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	int err=0;
+
+	// Monitor readers start at the live position of the ring
+	if(alsa_android->monitor){
+		alsa_android->monitor_pos=monitor_position(alsa_android->monitor_ring);
+		if(monitor_rate(alsa_android->monitor_ring) && monitor_rate(alsa_android->monitor_ring)!=io->rate)
+			SNDERR("Monitor opened at %u Hz, playback runs at %u Hz",
+			       io->rate, monitor_rate(alsa_android->monitor_ring));
+		alsa_android_monitor_arm(alsa_android, 1);
+		return 0;
+	}
+
+	err=alsa_android_prepare1(io);
+	if(err)
+		return err;
+
+	if(alsa_android->tsched){
+		// The device is started by the feeder once it has data
+		if(alsa_android->feeder_running)
+			return 0;
+		alsa_android->feeder_err=0;
+		alsa_android->feeder_running=1;
+		err=pthread_create(&alsa_android->feeder, NULL, alsa_android_feeder, alsa_android);
+		if(err)
+			alsa_android->feeder_running=0;
+		return err;
+	}
+
+	err=alsa_android_prepare2(io);
+	
+	return err;	
+}
+
+static snd_pcm_sframes_t alsa_android_tsched_transfer(snd_pcm_ioplug_t * io,
+                                                      const snd_pcm_channel_area_t * areas,
+                                                      snd_pcm_uframes_t offset,
+                                                      snd_pcm_uframes_t size)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	char *buf;
+	snd_pcm_uframes_t ring_offset, behind;
+
+	buf = (char *)areas->addr + (areas->first + areas->step * offset) / 8;
+
+	/*
+	 	After a rewind that raced with the feeder, the first frames may
+	 	have been handed to the device already. They are consumed without
+	 	being stored, so the rest lands at the right position.
+	 */
+	pthread_mutex_lock(&alsa_android->lock);
+	behind=alsa_android_tsched_distance(alsa_android, alsa_android->hw, io->appl_ptr);
+	if(behind && behind<=io->buffer_size){
+		if(size>behind)
+			size=behind;
+		alsa_android->appl=alsa_android->hw;
+		pthread_mutex_unlock(&alsa_android->lock);
+		return size;
 	}
-		
-	snd_pcm_ioplug_reinit_status(io);
-	return 0;
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	/*
+	 	The ring mirrors the application buffer, so frames written again
+	 	after a rewind land on the slots they replace.
+	 */
+	ring_offset=io->appl_ptr % io->buffer_size;
+	if(ring_offset + size > io->buffer_size)
+		size=io->buffer_size - ring_offset;
+
+	pthread_mutex_lock(&alsa_android->lock);
+	memcpy(alsa_android->ring + ring_offset * alsa_android->bytes_per_frame, buf,
+	       size * alsa_android->bytes_per_frame);
+	alsa_android->appl=io->appl_ptr + size;
+	if(alsa_android->appl>=alsa_android->boundary)
+		alsa_android->appl-=alsa_android->boundary;
+	alsa_android_tsched_arm(alsa_android);
+	pthread_cond_broadcast(&alsa_android->cond);
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	return size;
 }
 
-static int alsa_android_prepare2(snd_pcm_ioplug_t * io)
+static long long alsa_android_ns_since(const struct timespec *then)
 {
-	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	struct timespec now;
 
-	if(alsa_android->started)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000000LL + now.tv_nsec - then->tv_nsec;
+}
 
-	if(!ioctl(alsa_android->io.poll_fd, AUDIO_START, 0)){
-		alsa_android->started++;
-		long volume=3;
-		shared_props_get_volume(&volume);
-		set_volume_rpc(volume);
+// Period sizes tried by the auto tuning, smallest first
+static const unsigned int autotune_playback[] = {
+	960 * 2, 960 * 3, 960 * 4, 960 * 5, 960 * 10
+};
+static const unsigned int autotune_capture[] = {
+	512, 1024, 2048, 4096
+};
+
+/*
+ 	Stores the smallest period lasting AUTOTUNE_SAFETY times the worst gap
+ 	seen, in frames, for the route, rate and channels the stream ran with.
+ */
+static void alsa_android_autotune_commit(snd_pcm_alsa_android_t *alsa_android)
+{
+	snd_pcm_ioplug_t *io = &alsa_android->io;
+	const unsigned int *ladder=io->stream==SND_PCM_STREAM_PLAYBACK ? autotune_playback : autotune_capture;
+	unsigned int count=io->stream==SND_PCM_STREAM_PLAYBACK ? ARRAY_SIZE(autotune_playback) : ARRAY_SIZE(autotune_capture);
+	long long bytes_per_sec=(long long)alsa_android->sample_rate * alsa_android->bytes_per_frame;
+	unsigned int i;
+
+	for(i=0; i<count - 1; i++){
+		if(ladder[i] * 1000000000LL / bytes_per_sec>=alsa_android->autotune_gap_max * AUTOTUNE_SAFETY)
+			break;
 	}
-	
-	return 0;
+	shared_props_set_tuned_period(io->stream, alsa_android->old_route, alsa_android->sample_rate, io->channels,
+	                              ladder[i] / alsa_android->bytes_per_frame);
+	alsa_android->autotune_done=1;
+	TRACE_MARK("autotune", ladder[i] / alsa_android->bytes_per_frame);
 }
 
-static int alsa_android_start(snd_pcm_ioplug_t * io)
+// Measures the time the application spent since the previous transfer
+static void alsa_android_autotune_begin(snd_pcm_alsa_android_t *alsa_android)
 {
-	int err=0;
+	long long gap;
 
-	err=alsa_android_prepare1(io);
-	if(err)
-		return err;
-	err=alsa_android_prepare2(io);
-	
-	return err;	
+	if(!alsa_android->autotune_last.tv_sec && !alsa_android->autotune_last.tv_nsec)
+		return;
+	gap=alsa_android_ns_since(&alsa_android->autotune_last);
+	if(gap>alsa_android->autotune_gap_max)
+		alsa_android->autotune_gap_max=gap;
+}
+
+static void alsa_android_autotune_end(snd_pcm_alsa_android_t *alsa_android, snd_pcm_uframes_t frames)
+{
+	clock_gettime(CLOCK_MONOTONIC, &alsa_android->autotune_last);
+	alsa_android->autotune_frames+=frames;
+	if(alsa_android->autotune_frames>=alsa_android->sample_rate * AUTOTUNE_MS / 1000)
+		alsa_android_autotune_commit(alsa_android);
 }
 
 static snd_pcm_sframes_t alsa_android_transfer(snd_pcm_ioplug_t * io,
@@ -166,41 +1257,38 @@ static snd_pcm_sframes_t alsa_android_transfer(snd_pcm_ioplug_t * io,
 	char *buf;
 	int buf_size;
 	ssize_t result=0;
-	int err;
 
-	/*
-	 	Initializes the fd and stream parameters
-	 */
-	err=alsa_android_prepare1(io);
-	if(err)
-		return err;
-
-	buf_size = size * alsa_android->bytes_per_frame;
+	if(alsa_android->tsched)
+		return alsa_android_tsched_transfer(io, areas, offset, size);
 
-	if (buf_size > alsa_android->buffer_size) {
-		buf_size = alsa_android->buffer_size;
+	if(alsa_android->monitor){
+		buf = (char *)areas->addr + (areas->first + areas->step * offset) / 8;
+		result = monitor_read(alsa_android->monitor_ring, &alsa_android->monitor_pos,
+		                      (int16_t *)buf, size, io->channels, io->nonblock);
+		if(result>0)
+			alsa_android->hw_pointer += result;
+		return result;
 	}
 
+	buf_size = size * alsa_android->bytes_per_frame;
+
 	buf = (char *)areas->addr + (areas->first + areas->step * offset) / 8;
 
-	// The buffer is filled before calling start
-	if (io->stream == SND_PCM_STREAM_PLAYBACK){
-		result = write (alsa_android->io.poll_fd, buf, buf_size);
-	}
+	if(alsa_android->autotune && !alsa_android->autotune_done)
+		alsa_android_autotune_begin(alsa_android);
 
-	/*
-	 	call start after filling the buffer for playback or before reading
-	 */
-	err=alsa_android_prepare2(io);
-	if(err)
-		return err;
-	
-	if (io->stream != SND_PCM_STREAM_PLAYBACK){
-		result = read (alsa_android->io.poll_fd, buf, buf_size);
-	}
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		result = alsa_android_write_device(io, buf, buf_size);
+	else
+		result = alsa_android_read_device(io, buf, buf_size);
+	if(result<0)
+		return result;
 	
 	result /= alsa_android->bytes_per_frame;
 
+	if(alsa_android->autotune && !alsa_android->autotune_done)
+		alsa_android_autotune_end(alsa_android, result);
+
 	alsa_android->hw_pointer += result;
 
 	return result;
@@ -211,12 +1299,25 @@ static int alsa_android_stop(snd_pcm_ioplug_t * io)
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 	int ret;
 
-	ret=ioctl(alsa_android->io.poll_fd, AUDIO_STOP, 0);
-	alsa_android->started=0;
+	if(alsa_android->tsched)
+		alsa_android_feeder_stop(alsa_android);
 
-	if(alsa_android->io.poll_fd>-1)
-		close(alsa_android->io.poll_fd);
-	alsa_android->io.poll_fd=-1;
+	if(alsa_android->monitor){
+		alsa_android_monitor_arm(alsa_android, 0);
+		return 0;
+	}
+
+	TRACE_BEGIN(t);
+	ret=ioctl(alsa_android->fd, AUDIO_STOP, 0);
+	TRACE_END(t, "AUDIO_STOP", io->stream);
+
+	alsa_android_close_device(alsa_android);
+
+	// The time until the next start is not a gap of the application
+	memset(&alsa_android->autotune_last, 0, sizeof(alsa_android->autotune_last));
+
+	// Meters of a stopped stream read as silence
+	shared_props_set_levels(io->stream, 0, 0);
 	
 	if(ret==-1)
 		return errno;
@@ -228,6 +1329,19 @@ static snd_pcm_sframes_t alsa_android_pointer(snd_pcm_ioplug_t * io)
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 	snd_pcm_sframes_t ret;
 
+	if(alsa_android->tsched){
+		pthread_mutex_lock(&alsa_android->lock);
+		if(alsa_android->feeder_err){
+			ret=alsa_android->feeder_err;
+		}else{
+			// Picks up rewinds and forwards done by the application
+			alsa_android_tsched_sync(alsa_android);
+			ret=alsa_android->hw % io->buffer_size;
+		}
+		pthread_mutex_unlock(&alsa_android->lock);
+		return ret;
+	}
+
 	ret = alsa_android->hw_pointer;
 	if (alsa_android->hw_pointer == 0)
 		alsa_android->hw_pointer = io->period_size * alsa_android->bytes_per_frame;
@@ -237,14 +1351,163 @@ static snd_pcm_sframes_t alsa_android_pointer(snd_pcm_ioplug_t * io)
 	return ret;
 }
 
+static int alsa_android_poll_revents(snd_pcm_ioplug_t * io, struct pollfd *pfd,
+                                     unsigned int nfds, unsigned short *revents)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	uint64_t expirations;
+	snd_pcm_uframes_t avail;
+
+	*revents=0;
+	if(alsa_android->monitor){
+		if(pfd[0].revents & POLLIN){
+			read(alsa_android->timer_fd, &expirations, sizeof(expirations));
+			if(monitor_position(alsa_android->monitor_ring)!=alsa_android->monitor_pos)
+				*revents=POLLIN;
+		}
+		return 0;
+	}
+	if(!alsa_android->tsched){
+		*revents=pfd[0].revents;
+		return 0;
+	}
+
+	if(!(pfd[0].revents & POLLIN))
+		return 0;
+	read(alsa_android->timer_fd, &expirations, sizeof(expirations));
+
+	pthread_mutex_lock(&alsa_android->lock);
+	avail=io->buffer_size - alsa_android_tsched_queued(alsa_android);
+	if(avail>=io->period_size || alsa_android->feeder_err)
+		*revents=POLLOUT;
+	else
+		alsa_android_tsched_arm(alsa_android);
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	return 0;
+}
+
+/*
+ 	Waits until the device played the frames written to it, as counted by
+ 	AUDIO_GET_STATS or else from the time since the start. Bounded by the
+ 	time the device could still hold, in case the count stops short.
+ */
+static void alsa_android_device_drain(snd_pcm_alsa_android_t *alsa_android)
+{
+	struct msm_audio_stats stats;
+	struct timespec begin;
+	long long pending, limit_ns;
+
+	if(alsa_android->fd<0 || !alsa_android->started || alsa_android->suspended)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	limit_ns=(alsa_android_device_queued(alsa_android) + alsa_android->buffer_size / alsa_android->bytes_per_frame) *
+	         1000000000LL / alsa_android->sample_rate;
+	while(alsa_android_ns_since(&begin)<limit_ns){
+		if(!ioctl(alsa_android->fd, AUDIO_GET_STATS, &stats))
+			pending=(long long)alsa_android->device_frames - stats.byte_count / alsa_android->bytes_per_frame;
+		else
+			pending=alsa_android_device_queued(alsa_android);
+		if(pending<=0)
+			break;
+		TRACE_MARK("drain_wait", pending);
+		usleep(pending * 1000000 / alsa_android->sample_rate);
+	}
+}
+
+static int alsa_android_drain(snd_pcm_ioplug_t * io)
+{
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
+	int err;
+
+	if(io->stream!=SND_PCM_STREAM_PLAYBACK || alsa_android->monitor)
+		return 0;
+
+	// The last write has returned, what is left is in the device
+	if(!alsa_android->tsched){
+		alsa_android_device_drain(alsa_android);
+		return 0;
+	}
+
+	// Short streams may not have reached the start threshold yet
+	if(!alsa_android->feeder_running){
+		err=alsa_android_start(io);
+		if(err)
+			return err;
+	}
+
+	pthread_mutex_lock(&alsa_android->lock);
+	// The end of the stream is not a gap to conceal
+	alsa_android->draining=1;
+	while(alsa_android->feeder_running &&
+	      (alsa_android_tsched_queued(alsa_android) || alsa_android->feeder_busy))
+		pthread_cond_wait(&alsa_android->cond, &alsa_android->lock);
+	pthread_mutex_unlock(&alsa_android->lock);
+
+	alsa_android_device_drain(alsa_android);
+
+	return 0;
+}
+
 static int alsa_android_close(snd_pcm_ioplug_t * io)
 {
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 
-	if(alsa_android->io.poll_fd>-1)
-		close(alsa_android->io.poll_fd);
+	if(alsa_android->tsched){
+		alsa_android_feeder_stop(alsa_android);
+		close(alsa_android->timer_fd);
+		alsa_android->timer_fd=-1;
+		pthread_mutex_destroy(&alsa_android->lock);
+		pthread_cond_destroy(&alsa_android->cond);
+		free(alsa_android->ring);
+		alsa_android->ring=NULL;
+		free(alsa_android->conceal_hist);
+		alsa_android->conceal_hist=NULL;
+		drift_free(alsa_android->drift);
+		alsa_android->drift=NULL;
+	}
 
-	alsa_android->started=0;
+	if(alsa_android->monitor_ring){
+		if(alsa_android->monitor){
+			monitor_remove_reader(alsa_android->monitor_ring, alsa_android->monitor_slot);
+			close(alsa_android->timer_fd);
+			alsa_android->timer_fd=-1;
+		}
+		monitor_detach(alsa_android->monitor_ring);
+		alsa_android->monitor_ring=NULL;
+	}
+
+	if(alsa_android->duplex_group){
+		snd_pcm_alsa_android_t **p;
+
+		pthread_mutex_lock(&duplex_lock);
+		for(p=&duplex_list; *p; p=&(*p)->duplex_next){
+			if(*p==alsa_android){
+				*p=alsa_android->duplex_next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&duplex_lock);
+		free(alsa_android->duplex_group);
+		alsa_android->duplex_group=NULL;
+		aec_free(alsa_android->aec);
+		alsa_android->aec=NULL;
+	}
+
+	eq_free(alsa_android->eq);
+	alsa_android->eq=NULL;
+	free(alsa_android->scratch);
+	alsa_android->scratch=NULL;
+	preproc_free(alsa_android->preproc);
+	alsa_android->preproc=NULL;
+	free(alsa_android->encoder_device);
+	alsa_android->encoder_device=NULL;
+
+	shared_stream_unregister(alsa_android->stream_slot);
+	alsa_android->stream_slot=-1;
+
+	alsa_android_close_device(alsa_android);
 	
 	return 0;
 }
@@ -262,10 +1525,65 @@ static int alsa_android_hw_params(snd_pcm_ioplug_t * io,
 {
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 	int ret = 0;
+	char *ring;
 
 	alsa_android->sample_rate = io->rate;
+	alsa_android->idle_max = io->rate * alsa_android->idle_ms / 1000;
 
 	alsa_android->bytes_per_frame =	2 * io->channels;
+	if(alsa_android->encoder)
+		alsa_android->bytes_per_frame = 1;
+
+	if(alsa_android->tsched){
+		ring=realloc(alsa_android->ring, io->buffer_size * alsa_android->bytes_per_frame);
+		if(!ring)
+			return -ENOMEM;
+		alsa_android->ring=ring;
+
+		if(alsa_android->conceal){
+			int16_t *hist;
+
+			alsa_android->conceal_len=io->rate / 100;
+			hist=realloc(alsa_android->conceal_hist, alsa_android->conceal_len * alsa_android->bytes_per_frame);
+			if(!hist)
+				return -ENOMEM;
+			alsa_android->conceal_hist=hist;
+		}
+
+		if(alsa_android->drift_enabled){
+			struct drift *drift=drift_new(io->rate, io->channels);
+			if(!drift)
+				return -ENOMEM;
+			drift_free(alsa_android->drift);
+			alsa_android->drift=drift;
+		}
+
+		// Same wrap point alsa-lib uses for the application pointer
+		alsa_android->boundary=io->buffer_size;
+		while(alsa_android->boundary * 2 <= LONG_MAX - io->buffer_size)
+			alsa_android->boundary*=2;
+	}
+
+	if(alsa_android->eq)
+		eq_setup(alsa_android->eq, io->rate, io->channels);
+
+	if(alsa_android->preproc){
+		ret=preproc_setup(alsa_android->preproc, io->rate, io->channels);
+		if(ret)
+			return ret;
+	}
+
+	if(alsa_android->aec_enabled){
+		struct aec *aec=aec_new(alsa_android->aec_taps, io->rate);
+		if(!aec)
+			return -ENOMEM;
+
+		// The playback peer may be pushing reference frames
+		pthread_mutex_lock(&duplex_lock);
+		aec_free(alsa_android->aec);
+		alsa_android->aec=aec;
+		pthread_mutex_unlock(&duplex_lock);
+	}
 
 	return ret;
 }
@@ -280,19 +1598,82 @@ static int alsa_android_hw_params(snd_pcm_ioplug_t * io,
  */
 static int alsa_android_prepare(snd_pcm_ioplug_t * io)
 {
+	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 	int ret = 0;
+
+	if(alsa_android->tsched){
+		alsa_android_feeder_stop(alsa_android);
+		pthread_mutex_lock(&alsa_android->lock);
+		alsa_android->appl=0;
+		alsa_android->hw=0;
+		alsa_android->feeder_err=0;
+		alsa_android->draining=0;
+		alsa_android->paused=0;
+		alsa_android->conceal_frames=0;
+		alsa_android->conceal_gain=1.0f;
+		if(alsa_android->drift)
+			drift_reset(alsa_android->drift);
+		if(alsa_android->conceal_hist)
+			memset(alsa_android->conceal_hist, 0, alsa_android->conceal_len * alsa_android->bytes_per_frame);
+		alsa_android_tsched_arm(alsa_android);
+		pthread_mutex_unlock(&alsa_android->lock);
+	}
+
+	if(alsa_android->preproc)
+		preproc_reset(alsa_android->preproc);
+
+	/*
+	 	A duplex stream opens its device here, in its own thread, so the
+	 	peer starting first can start it too.
+	 */
+	if(alsa_android->duplex_group){
+		ret=alsa_android_prepare1(io);
+		if(ret)
+			return -ret;
+	}
+
 	return ret;
 }
 
+/*
+ 	Stops the device on pause and starts it again on release. In tsched
+ 	mode the feeder is parked first, once its write in progress returned.
+ */
 static int alsa_android_pause(snd_pcm_ioplug_t * io, int enable)
 {
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
-	int ret;
+	int ret=0;
+
+	if(alsa_android->monitor){
+		alsa_android_monitor_arm(alsa_android, !enable);
+		return 0;
+	}
+
+	if(alsa_android->tsched && enable){
+		pthread_mutex_lock(&alsa_android->lock);
+		alsa_android->paused=1;
+		while(alsa_android->feeder_busy)
+			pthread_cond_wait(&alsa_android->cond, &alsa_android->lock);
+		pthread_mutex_unlock(&alsa_android->lock);
+	}
 
-	ret=ioctl(alsa_android->io.poll_fd, AUDIO_STOP, 0);
+	// A suspended device is already stopped and resumes on its own
+	if(alsa_android->fd>-1 && alsa_android->started && !alsa_android->suspended){
+		TRACE_BEGIN(t);
+		ret=ioctl(alsa_android->fd, enable ? AUDIO_STOP : AUDIO_START, 0);
+		TRACE_END(t, enable ? "pause" : "pause_release", io->stream);
+	}
+
+	if(alsa_android->tsched && !enable){
+		pthread_mutex_lock(&alsa_android->lock);
+		alsa_android->paused=0;
+		alsa_android_tsched_arm(alsa_android);
+		pthread_cond_broadcast(&alsa_android->cond);
+		pthread_mutex_unlock(&alsa_android->lock);
+	}
 
 	if(ret==-1)
-		return errno;
+		return -errno;
 	return ret;
 }
 
@@ -301,7 +1682,7 @@ static int alsa_android_resume(snd_pcm_ioplug_t * io)
 	snd_pcm_alsa_android_t *alsa_android = io->private_data;
 	int ret;
 
-	ret=ioctl(alsa_android->io.poll_fd, AUDIO_START, 0);
+	ret=ioctl(alsa_android->fd, AUDIO_START, 0);
 
 	if(ret==-1)
 		ret=errno;
@@ -309,6 +1690,48 @@ static int alsa_android_resume(snd_pcm_ioplug_t * io)
 	return ret;
 }
 
+/*
+ 	Candidate periods from the tuned one up, with buffers of 2 or 4 of them.
+ 	The rate and channels of the new stream are not known yet, so the
+ 	smallest period tuned on the route in any of them is the lower bound.
+ 	Returns the number of periods, 0 when nothing was tuned.
+ */
+static unsigned int alsa_android_autotune_lists(snd_pcm_ioplug_t *io, int route, unsigned int *periods,
+                                                unsigned int *buffers, unsigned int *buffer_count)
+{
+	const unsigned int *ladder=io->stream==SND_PCM_STREAM_PLAYBACK ? autotune_playback : autotune_capture;
+	unsigned int count=io->stream==SND_PCM_STREAM_PLAYBACK ? ARRAY_SIZE(autotune_playback) : ARRAY_SIZE(autotune_capture);
+	unsigned int i, j, n=0, rate, channels, size;
+	unsigned long tuned=0;
+	int slot, stream, route_id;
+	long frames;
+
+	for(slot=0; slot<SHARED_TUNE_SLOTS; slot++){
+		if(shared_props_get_tuned_period(slot, &stream, &route_id, &rate, &channels, &frames) ||
+		   stream!=(int)io->stream || route_id!=route)
+			continue;
+		// S16 frames
+		if(!tuned || (unsigned long)frames * channels * 2<tuned)
+			tuned=(unsigned long)frames * channels * 2;
+	}
+	if(!tuned)
+		return 0;
+
+	*buffer_count=0;
+	for(i=0; i<count; i++){
+		if(ladder[i]<tuned)
+			continue;
+		periods[n++]=ladder[i];
+		for(size=ladder[i] * 2; size<=ladder[i] * 4; size+=ladder[i] * 2){
+			for(j=0; j<*buffer_count && buffers[j]!=size; j++)
+				;
+			if(j==*buffer_count)
+				buffers[(*buffer_count)++]=size;
+		}
+	}
+	return n;
+}
+
 static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_android)
 {
 	snd_pcm_ioplug_t *io = &alsa_android->io;
@@ -327,9 +1750,43 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 	static const unsigned int bytes_list_rec[] = {
 		2048, 2048*2
 	};
+	static const unsigned int formats_encoded[] = {
+		SND_PCM_FORMAT_U8,
+	};
+	unsigned int frames_list_encoded[3];
+	const unsigned int *periods, *buffers;
+	unsigned int period_count, buffer_count, periods_max=1024;
+	// The playback ladder is the longer one
+	unsigned int tuned_periods[ARRAY_SIZE(autotune_playback)], tuned_buffers[ARRAY_SIZE(autotune_playback) * 2];
+	unsigned int tuned_count=0, tuned_buffer_count=0;
+	int route=1;
 
 	int ret, err;
 
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		periods = buffers = bytes_list;
+		period_count = buffer_count = ARRAY_SIZE(bytes_list);
+	} else {
+		periods = buffers = bytes_list_rec;
+		period_count = buffer_count = ARRAY_SIZE(bytes_list_rec);
+	}
+
+	/*
+	 	Prefers the period tuned by earlier streams on the route: it is
+	 	the smallest offered, which alsa-lib picks unless asked otherwise.
+	 */
+	shared_props_get_route_id(&route);
+	if (alsa_android->autotune)
+		tuned_count = alsa_android_autotune_lists(io, route, tuned_periods,
+		                                          tuned_buffers, &tuned_buffer_count);
+	if (tuned_count) {
+		periods = tuned_periods;
+		buffers = tuned_buffers;
+		period_count = tuned_count;
+		buffer_count = tuned_buffer_count;
+		periods_max = 4;
+	}
+
 	/* Configuring access */
 	if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
 	                                         ARRAY_SIZE(access_list),
@@ -362,12 +1819,31 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 												 ret = err;
 												 goto out;
 											 }
+		if (alsa_android->tsched) {
+			/* Large buffers, the wakeups are driven by the timer */
+			if ((err = 
+			     snd_pcm_ioplug_set_param_minmax(io,
+			                                     SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+			                                     bytes_list[0],
+			                                     TSCHED_BUFFER_BYTES_MAX / 2)) < 0) {
+													 ret = err;
+													 goto out;
+												 }
+			if ((err = 
+			     snd_pcm_ioplug_set_param_minmax(io,
+			                                     SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+			                                     bytes_list[1],
+			                                     TSCHED_BUFFER_BYTES_MAX)) < 0) {
+													 ret = err;
+													 goto out;
+												 }
+		} else {
 		/* Configuring periods */
 		if ((err = 
 		     snd_pcm_ioplug_set_param_list(io,
 		                                   SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-		                                   ARRAY_SIZE(bytes_list),
-		                                   bytes_list)) < 0) {
+		                                   period_count,
+		                                   periods)) < 0) {
 											   ret = err;
 											   goto out;
 										   }
@@ -375,8 +1851,54 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 		if ((err = 
 		     snd_pcm_ioplug_set_param_list(io,
 		                                   SND_PCM_IOPLUG_HW_BUFFER_BYTES,
-		                                   ARRAY_SIZE(bytes_list),
-		                                   bytes_list)) < 0) {
+		                                   buffer_count,
+		                                   buffers)) < 0) {
+											   ret = err;
+											   goto out;
+										   }
+		}
+	} else if (alsa_android->encoder) {
+		unsigned int frame_bytes = alsa_android->encoder->frame_bytes;
+
+		/* Encoded bytes, the rate is the bit rate of the encoder */
+		if ((err =
+		     snd_pcm_ioplug_set_param_list(io,
+		                                   SND_PCM_IOPLUG_HW_FORMAT,
+		                                   ARRAY_SIZE(formats_encoded),
+		                                   formats_encoded)) < 0) {
+											   ret = err;
+											   goto out;
+										   }
+		if ((err = snd_pcm_ioplug_set_param_minmax(io,
+		                                           SND_PCM_IOPLUG_HW_CHANNELS,
+		                                           1, 1)) < 0) {
+													   ret = err;
+													   goto out;
+												   }
+		if ((err =
+		     snd_pcm_ioplug_set_param_minmax(io,
+		                                     SND_PCM_IOPLUG_HW_RATE,
+		                                     frame_bytes * ENCODER_FRAMES_PER_SEC,
+		                                     frame_bytes * ENCODER_FRAMES_PER_SEC)) < 0) {
+												 ret = err;
+												 goto out;
+											 }
+		/* Periods of 100ms and 200ms, buffers up to one second */
+		frames_list_encoded[0] = frame_bytes * 5;
+		frames_list_encoded[1] = frame_bytes * 10;
+		frames_list_encoded[2] = frame_bytes * ENCODER_FRAMES_PER_SEC;
+		if ((err =
+		     snd_pcm_ioplug_set_param_list(io,
+		                                   SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+		                                   2, frames_list_encoded)) < 0) {
+											   ret = err;
+											   goto out;
+										   }
+		if ((err =
+		     snd_pcm_ioplug_set_param_list(io,
+		                                   SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+		                                   ARRAY_SIZE(frames_list_encoded),
+		                                   frames_list_encoded)) < 0) {
 											   ret = err;
 											   goto out;
 										   }
@@ -410,9 +1932,8 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 		if ((err = 
 		     snd_pcm_ioplug_set_param_list(io, 
 		                                   SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-		                                   ARRAY_SIZE
-		                                   (bytes_list_rec),
-		                                   bytes_list_rec)) < 0) {
+		                                   period_count,
+		                                   periods)) < 0) {
 											   ret = err;
 											   goto out;
 										   }
@@ -420,9 +1941,8 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 		if ((err =
 		     snd_pcm_ioplug_set_param_list(io, 
 		                                   SND_PCM_IOPLUG_HW_BUFFER_BYTES,
-		                                   ARRAY_SIZE
-		                                   (bytes_list_rec),
-		                                   bytes_list_rec)) < 0) {
+		                                   buffer_count,
+		                                   buffers)) < 0) {
 											   ret = err;
 											   goto out;
 										   }
@@ -431,7 +1951,7 @@ static int alsa_android_configure_constraints(snd_pcm_alsa_android_t * alsa_andr
 
 	if ((err = snd_pcm_ioplug_set_param_minmax(io,
 	                                           SND_PCM_IOPLUG_HW_PERIODS,
-	                                           2, 1024)) < 0) {
+	                                           2, periods_max)) < 0) {
 												   ret = err;
 												   goto out;
 											   }
@@ -453,6 +1973,8 @@ static snd_pcm_ioplug_callback_t alsa_android_callback = {
 	.prepare = alsa_android_prepare,
 	.pause = alsa_android_pause,
 	.resume = alsa_android_resume,
+	.drain = alsa_android_drain,
+	.poll_revents = alsa_android_poll_revents,
 };
 
 /**
@@ -465,6 +1987,8 @@ SND_PCM_PLUGIN_DEFINE_FUNC(alsa_android)
 {
 	snd_config_iterator_t i, next;
 	snd_pcm_alsa_android_t *alsa_android;
+	const char *stream_name = NULL;
+	char comm[SHARED_STREAM_NAME_MAX];
 	int err;
 	int ret;
 
@@ -474,6 +1998,8 @@ SND_PCM_PLUGIN_DEFINE_FUNC(alsa_android)
 		ret = -ENOMEM;
 		goto out;
 	}
+	// Nothing to close on an early error
+	alsa_android->timer_fd = -1;
 
 	/* Read the configuration searching for configurated devices */
 	snd_config_for_each(i, next, conf) {
@@ -483,11 +2009,265 @@ SND_PCM_PLUGIN_DEFINE_FUNC(alsa_android)
 			continue;
 		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
 			continue;
+		if (strcmp(id, "tsched") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->tsched = err;
+			continue;
+		}
+		if (strcmp(id, "duplex_group") == 0) {
+			const char *group;
+			if ((err = snd_config_get_string(n, &group)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			free(alsa_android->duplex_group);
+			alsa_android->duplex_group = strdup(group);
+			continue;
+		}
+		if (strcmp(id, "aec") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->aec_enabled = err;
+			continue;
+		}
+		if (strcmp(id, "eq") == 0) {
+			if (snd_config_get_type(n) != SND_CONFIG_TYPE_COMPOUND) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			eq_free(alsa_android->eq);
+			alsa_android->eq = NULL;
+			if ((err = eq_new(&alsa_android->eq, n)) < 0)
+				goto error;
+			continue;
+		}
+		if (strcmp(id, "stream_name") == 0) {
+			if (snd_config_get_string(n, &stream_name) < 0) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "autotune") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->autotune = err;
+			continue;
+		}
+		if (strcmp(id, "idle_suspend") == 0) {
+			long ms;
+			if (snd_config_get_integer(n, &ms) < 0 || ms < 0) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			alsa_android->idle_ms = ms;
+			continue;
+		}
+		if (strcmp(id, "drift") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->drift_enabled = err;
+			continue;
+		}
+		if (strcmp(id, "conceal") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->conceal = err;
+			continue;
+		}
+		if (strcmp(id, "preproc") == 0) {
+			if (snd_config_get_type(n) != SND_CONFIG_TYPE_COMPOUND) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			preproc_free(alsa_android->preproc);
+			alsa_android->preproc = NULL;
+			if ((err = preproc_new(&alsa_android->preproc, n)) < 0)
+				goto error;
+			continue;
+		}
+		if (strcmp(id, "monitor") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			alsa_android->monitor = err;
+			continue;
+		}
+		if (strcmp(id, "vad") == 0) {
+			const char *vad;
+			if (snd_config_get_string(n, &vad) < 0) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if (strcmp(vad, "off") == 0)
+				alsa_android->vad = VAD_OFF;
+			else if (strcmp(vad, "gate") == 0)
+				alsa_android->vad = VAD_GATE;
+			else if (strcmp(vad, "skip") == 0)
+				alsa_android->vad = VAD_SKIP;
+			else {
+				SNDERR("Invalid value for %s, expected off, gate or skip", id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "vad_threshold") == 0) {
+			double db;
+			if (snd_config_get_ireal(n, &db) < 0 || db > 0) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			alsa_android->vad_threshold = pow(10.0, db / 10.0);
+			continue;
+		}
+		if (strcmp(id, "encoder") == 0) {
+			const char *enc;
+			unsigned int k;
+			if (snd_config_get_string(n, &enc) < 0) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			alsa_android->encoder = NULL;
+			for (k = 0; k < ARRAY_SIZE(encoders); k++) {
+				if (strcmp(enc, encoders[k].name) == 0)
+					alsa_android->encoder = &encoders[k];
+			}
+			if (!alsa_android->encoder && strcmp(enc, "none") != 0) {
+				SNDERR("Invalid value for %s, expected none, amrnb, qcelp or evrc", id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "encoder_device") == 0) {
+			const char *path;
+			if ((err = snd_config_get_string(n, &path)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				goto error;
+			}
+			free(alsa_android->encoder_device);
+			alsa_android->encoder_device = strdup(path);
+			continue;
+		}
+		if (strcmp(id, "aec_taps") == 0) {
+			long taps;
+			if (snd_config_get_integer(n, &taps) < 0 || taps < 16 || taps > 4096) {
+				SNDERR("Invalid value for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			alsa_android->aec_taps = taps;
+			continue;
+		}
 		SNDERR("Unknown field %s", id);
 		err = -EINVAL;
 		goto error;
 	}
 
+	// Timer based scheduling is only implemented for playback
+	if (stream != SND_PCM_STREAM_PLAYBACK)
+		alsa_android->tsched = 0;
+
+	// Gaps are filled by the feeder thread of timer based scheduling
+	if (alsa_android->conceal && !alsa_android->tsched) {
+		SNDERR("conceal needs tsched on a playback PCM");
+		err = -EINVAL;
+		goto error;
+	}
+
+	// Suspending playback would break the timeline of a duplex group
+	if (stream != SND_PCM_STREAM_PLAYBACK)
+		alsa_android->idle_ms = 0;
+	if (alsa_android->idle_ms && alsa_android->duplex_group) {
+		SNDERR("idle_suspend can not be combined with duplex_group");
+		err = -EINVAL;
+		goto error;
+	}
+
+	// The resampler runs on the feeder too
+	if (alsa_android->drift_enabled && !alsa_android->tsched) {
+		SNDERR("drift needs tsched on a playback PCM");
+		err = -EINVAL;
+		goto error;
+	}
+
+	// The echo canceller filters capture, using the playback of its group
+	if (stream == SND_PCM_STREAM_PLAYBACK)
+		alsa_android->aec_enabled = 0;
+	if (alsa_android->aec_enabled && !alsa_android->duplex_group) {
+		SNDERR("aec needs a duplex_group with a playback PCM");
+		err = -EINVAL;
+		goto error;
+	}
+	if (!alsa_android->aec_taps)
+		alsa_android->aec_taps = 256;
+
+	// The monitor is a capture of what the playback PCMs write
+	if (stream == SND_PCM_STREAM_PLAYBACK)
+		alsa_android->monitor = 0;
+
+	// Voice activity detection only applies to capture
+	if (stream == SND_PCM_STREAM_PLAYBACK)
+		alsa_android->vad = VAD_OFF;
+	if (!alsa_android->vad_threshold)
+		alsa_android->vad_threshold = pow(10.0, -50.0 / 10.0);
+
+	// The equalizer only applies to playback
+	if (stream != SND_PCM_STREAM_PLAYBACK) {
+		eq_free(alsa_android->eq);
+		alsa_android->eq = NULL;
+	}
+
+	// Preprocessing is for the samples of a raw capture
+	if (stream == SND_PCM_STREAM_PLAYBACK || alsa_android->monitor) {
+		preproc_free(alsa_android->preproc);
+		alsa_android->preproc = NULL;
+	}
+
+	/*
+	 	Encoded capture, the samples never reach the plugin. Without the
+	 	encoder node the PCM falls back to raw capture.
+	 */
+	if (stream == SND_PCM_STREAM_PLAYBACK || alsa_android->monitor)
+		alsa_android->encoder = NULL;
+	if (alsa_android->encoder) {
+		if (alsa_android->aec_enabled || alsa_android->vad != VAD_OFF || alsa_android->duplex_group) {
+			SNDERR("encoder can not be combined with aec, vad or duplex_group");
+			err = -EINVAL;
+			goto error;
+		}
+		if (!alsa_android->encoder_device)
+			alsa_android->encoder_device = strdup(alsa_android->encoder->device);
+		if (access(alsa_android->encoder_device, R_OK) != 0) {
+			SNDERR("%s not available, capturing raw PCM", alsa_android->encoder_device);
+			alsa_android->encoder = NULL;
+		}
+	}
+
+	// Tuning applies to the fixed period lists of the direct device transfers
+	if (alsa_android->tsched || alsa_android->monitor || alsa_android->encoder)
+		alsa_android->autotune = 0;
+
 	/* Initialise the snd_pcm_ioplug_t */
 	alsa_android->io.version = SND_PCM_IOPLUG_VERSION;
 	alsa_android->io.name = "Alsa - Android PCM Plugin";
@@ -502,7 +2282,56 @@ SND_PCM_PLUGIN_DEFINE_FUNC(alsa_android)
 			alsa_android->io.poll_events = POLLIN;
 	}
 
+	alsa_android->fd=-1;
 	alsa_android->io.poll_fd=-1;
+	// Not registered yet, so a close on a failed open leaves the registry alone
+	alsa_android->stream_slot=-1;
+
+	if (alsa_android->tsched) {
+		alsa_android->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (alsa_android->timer_fd == -1) {
+			err = -errno;
+			SNDERR("timerfd_create failed: %s", strerror(-err));
+			goto error;
+		}
+		alsa_android->io.poll_fd = alsa_android->timer_fd;
+		alsa_android->io.poll_events = POLLIN;
+		pthread_mutex_init(&alsa_android->lock, NULL);
+		pthread_condattr_t attr;
+
+		// The concealment deadlines are on the monotonic clock
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&alsa_android->cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+
+	if (alsa_android->monitor) {
+		alsa_android->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (alsa_android->timer_fd == -1) {
+			err = -errno;
+			SNDERR("timerfd_create failed: %s", strerror(-err));
+			goto error;
+		}
+		alsa_android->io.poll_fd = alsa_android->timer_fd;
+		alsa_android->monitor_ring = monitor_attach();
+		if (!alsa_android->monitor_ring) {
+			SNDERR("Monitor ring access failed: %s", strerror(errno));
+			err = -EIO;
+			goto error;
+		}
+		alsa_android->monitor_slot = monitor_add_reader(alsa_android->monitor_ring);
+		if (alsa_android->monitor_slot < 0) {
+			SNDERR("No free monitor reader slot, %d readers at most", MONITOR_READERS);
+			monitor_detach(alsa_android->monitor_ring);
+			alsa_android->monitor_ring = NULL;
+			err = -EBUSY;
+			goto error;
+		}
+	} else if (stream == SND_PCM_STREAM_PLAYBACK) {
+		// Without the ring the playback simply is not monitored
+		alsa_android->monitor_ring = monitor_attach();
+	}
 
 	alsa_android->io.private_data = alsa_android;
 
@@ -517,16 +2346,70 @@ SND_PCM_PLUGIN_DEFINE_FUNC(alsa_android)
 	}
 
 	*pcmp = alsa_android->io.pcm;
+	TRACE_MARK("pcm_open", stream);
 
-	int route=1;
-	
-	shared_props_get_route_id(&route);
-	do_route_audio_rpc (route, SND_MUTE_MUTED, SND_MUTE_MUTED);
+	/*
+	 	Registers the PCM for its own volume and mute, under the program
+	 	name unless configured. A monitor is a tap and encoded frames can
+	 	not be scaled, those are not registered.
+	 */
+	if (!alsa_android->monitor && !alsa_android->encoder) {
+		if (!stream_name) {
+			FILE *f = fopen("/proc/self/comm", "r");
+			stream_name = "PCM";
+			if (f) {
+				if (fgets(comm, sizeof(comm), f)) {
+					comm[strcspn(comm, "\n")] = 0;
+					stream_name = comm;
+				}
+				fclose(f);
+			}
+		}
+		alsa_android->stream_slot = shared_stream_register(stream, stream_name);
+		if (alsa_android->stream_slot < 0)
+			SNDERR("Stream registry full, %s has no own volume", stream_name);
+	}
+
+	if (alsa_android->duplex_group) {
+		pthread_mutex_lock(&duplex_lock);
+		alsa_android->duplex_next = duplex_list;
+		duplex_list = alsa_android;
+		pthread_mutex_unlock(&duplex_lock);
+	}
+
+	/*
+	 	Routes with the mutes as published, one snapshot of the call
+	 	state, so opening a PCM does not mute a call in progress.
+	 */
+	struct shared_call_state call;
+
+	if (!shared_props_get_call(&call, NULL))
+		do_route_audio_rpc (call.route_id, call.ear_mute, call.mic_mute);
 
 	ret = 0;
 	goto out;
 error:
 	ret = err;
+	/*
+	 	A failed open leaves the timer, and with tsched its lock, to clean
+	 	up here. After snd_pcm_ioplug_delete the close callback did it.
+	 */
+	if (alsa_android->timer_fd >= 0) {
+		close(alsa_android->timer_fd);
+		if (alsa_android->tsched) {
+			pthread_mutex_destroy(&alsa_android->lock);
+			pthread_cond_destroy(&alsa_android->cond);
+		}
+	}
+	if (alsa_android->monitor_ring) {
+		if (alsa_android->monitor)
+			monitor_remove_reader(alsa_android->monitor_ring, alsa_android->monitor_slot);
+		monitor_detach(alsa_android->monitor_ring);
+	}
+	free(alsa_android->duplex_group);
+	free(alsa_android->encoder_device);
+	eq_free(alsa_android->eq);
+	preproc_free(alsa_android->preproc);
 	free(alsa_android);
 out:
 	return ret;
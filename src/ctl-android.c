@@ -30,6 +30,8 @@
 #include <linux/msm_audio.h>
 
 #include "utils.h"
+#include "trace.h"
+#include "hotplug.h"
 
 typedef struct snd_ctl_android {
 	snd_ctl_ext_t ext;
@@ -37,19 +39,75 @@ typedef struct snd_ctl_android {
 	struct msm_snd_endpoint *end_point_list;
 	pthread_t monitor_thread;
 	int push_fd;
+	/*
+	 	Headset watcher, run by a single control instance of the system.
+	 	The others retry from the monitor thread in case its owner dies.
+	 */
+	struct hotplug *hotplug;
+	int hotplug_enabled;
+	char *hotplug_switch;
+	char *hotplug_uevent;
+	char *hotplug_headset;
+	// Serializes route changes of the application and of the hotplug thread
+	pthread_mutex_t route_lock;
+
+	/*
+	 	Registry slots as last seen by the monitor thread, so removed
+	 	streams can still be named in their remove events.
+	 */
+	pthread_mutex_t streams_lock;
+	struct {
+		int pid;
+		int stream;
+		char name[SHARED_STREAM_NAME_MAX];
+	} streams[SHARED_STREAM_SLOTS];
 } snd_ctl_android_t;
 
 enum{
 	CTL_ANDROID_VOLUME=1,
 	CTL_ANDROID_ROUTE=2,
-	CTL_ANDROID_REC=3};
-#define CTL_ANDROID_COUNT 2
+	CTL_ANDROID_REC=3,
+	CTL_ANDROID_DUPLEX_LATENCY=4,
+	CTL_ANDROID_PLAYBACK_PEAK=5,
+	CTL_ANDROID_PLAYBACK_RMS=6,
+	CTL_ANDROID_CAPTURE_PEAK=7,
+	CTL_ANDROID_CAPTURE_RMS=8,
+	CTL_ANDROID_EAR=9,
+	CTL_ANDROID_MIC=10,
+	CTL_ANDROID_CALL=11};
+#define CTL_ANDROID_COUNT 11
+
+// Steps of the voice volume sent with SND_SET_VOLUME
+#define CTL_ANDROID_VOLUME_MAX	5
+
+// Values of the Call Setup element, written as one transaction
+enum{
+	CTL_ANDROID_CALL_ROUTE,
+	CTL_ANDROID_CALL_EAR,
+	CTL_ANDROID_CALL_MIC,
+	CTL_ANDROID_CALL_VOLUME,
+	CTL_ANDROID_CALL_COUNT};
+
+/*
+ 	Each registered stream adds a volume and a switch element, keyed by its
+ 	registry slot: volume at CTL_ANDROID_STREAM + 2 * slot, switch after it.
+ */
+#define CTL_ANDROID_STREAM	16
+#define CTL_ANDROID_STREAM_SLOT(key)	(((key) - CTL_ANDROID_STREAM) / 2)
+#define CTL_ANDROID_STREAM_MUTE(key)	(((key) - CTL_ANDROID_STREAM) & 1)
+
+// Pushed to the event pipe with a stream key, when the element comes or goes
+#define CTL_ANDROID_EVENT_ADD	0x10000
+#define CTL_ANDROID_EVENT_REMOVE	0x20000
+
+// Longest sleep of the monitor thread, short enough for level meters
+#define MONITOR_PERIOD_US 250000
 
 static int do_route_audio_rpc(uint32_t device, int ear_mute, int mic_mute)
 {
 	int fd;
 
-	fd = open ("/dev/msm_snd", O_RDWR);
+	fd = snd_control_open ();
 	if (fd < 0)
 	{
 		perror ("Can not open snd device");
@@ -61,19 +119,114 @@ static int do_route_audio_rpc(uint32_t device, int ear_mute, int mic_mute)
 	args.ear_mute = ear_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 	args.mic_mute = mic_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 
-	if (ioctl (fd, SND_SET_DEVICE, &args) < 0)
+	TRACE_BEGIN(t);
+	int ret = ioctl (fd, SND_SET_DEVICE, &args);
+	TRACE_END(t, "SND_SET_DEVICE", device);
+	if (ret < 0)
 	{
 		perror ("snd_set_device error.");
-		close (fd);
 		return -1;
 	}
 
-	close (fd);
 	return 0;
 }
 
+/*
+ 	Publishes the given fields of the call state as one change, then sends
+ 	only the RPCs it needs: one SND_SET_DEVICE for the route and mutes, the
+ 	volume if it changed. force adds RPCs for fields that did not change.
+ */
+static int android_set_call(snd_ctl_android_t *android, struct shared_call_state *call,
+                            int fields, int force)
+{
+	struct shared_call_state latest;
+	int changed, seq, latest_seq, ret=0;
+
+	pthread_mutex_lock(&android->route_lock);
+	changed=shared_props_set_call(call, fields, &seq);
+	if(changed<0){
+		pthread_mutex_unlock(&android->route_lock);
+		return changed;
+	}
+	changed|=force;
+
+	while(changed){
+		if(changed & (SHARED_CALL_ROUTE | SHARED_CALL_MUTE))
+			ret=do_route_audio_rpc(call->route_id, call->ear_mute, call->mic_mute);
+		if(!ret && (changed & SHARED_CALL_VOLUME))
+			ret=set_volume_rpc(call->volume);
+		if(ret)
+			break;
+
+		/*
+		 	Another process may have published its own state and sent its
+		 	RPCs before ours, leave the device on the latest state.
+		 */
+		if(shared_props_get_call(&latest, &latest_seq) || latest_seq==seq)
+			break;
+		changed=0;
+		if(latest.route_id!=call->route_id)
+			changed|=SHARED_CALL_ROUTE;
+		if(latest.ear_mute!=call->ear_mute || latest.mic_mute!=call->mic_mute)
+			changed|=SHARED_CALL_MUTE;
+		if(latest.volume!=call->volume)
+			changed|=SHARED_CALL_VOLUME;
+		*call=latest;
+		seq=latest_seq;
+	}
+	pthread_mutex_unlock(&android->route_lock);
+
+	return ret;
+}
+
+/*
+ 	Names the element of a registered stream, "<program> Playback Volume"
+ 	or "<program> Capture Switch", with the slot as the element index.
+ */
+static void android_stream_id(snd_ctl_android_t *android, snd_ctl_ext_key_t key, snd_ctl_elem_id_t *id)
+{
+	int slot=CTL_ANDROID_STREAM_SLOT(key);
+	char name[SHARED_STREAM_NAME_MAX + 32];
+
+	pthread_mutex_lock(&android->streams_lock);
+	snprintf(name, sizeof(name), "%s %s %s", android->streams[slot].name,
+	         android->streams[slot].stream==SND_PCM_STREAM_PLAYBACK ? "Playback" : "Capture",
+	         CTL_ANDROID_STREAM_MUTE(key) ? "Switch" : "Volume");
+	pthread_mutex_unlock(&android->streams_lock);
+
+	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_id_set_name(id, name);
+	snd_ctl_elem_id_set_index(id, slot);
+}
+
+// Key of the stream element at offset, counting past the fixed elements
+static snd_ctl_ext_key_t android_stream_key(snd_ctl_android_t *android, unsigned int offset)
+{
+	unsigned int n=(offset - CTL_ANDROID_COUNT) / 2;
+	int slot;
+
+	pthread_mutex_lock(&android->streams_lock);
+	for(slot=0; slot<SHARED_STREAM_SLOTS; slot++){
+		if(android->streams[slot].pid && !n--)
+			break;
+	}
+	pthread_mutex_unlock(&android->streams_lock);
+
+	if(slot==SHARED_STREAM_SLOTS)
+		return SND_CTL_EXT_KEY_NOT_FOUND;
+	return CTL_ANDROID_STREAM + 2 * slot + (offset - CTL_ANDROID_COUNT) % 2;
+}
+
 static int android_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_elem_id_t *id)
 {
+	if(offset>=CTL_ANDROID_COUNT){
+		snd_ctl_ext_key_t key=android_stream_key(ext->private_data, offset);
+		if(key==SND_CTL_EXT_KEY_NOT_FOUND)
+			return -EINVAL;
+		android_stream_id(ext->private_data, key, id);
+		return 0;
+	}
+
 	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
 	switch(offset){
 		case 0:
@@ -85,6 +238,30 @@ static int android_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_el
 		case 2:
 			snd_ctl_elem_id_set_name(id, "Record Capture Switch");
 			break;
+		case 3:
+			snd_ctl_elem_id_set_name(id, "Duplex Round Trip Latency");
+			break;
+		case 4:
+			snd_ctl_elem_id_set_name(id, "Playback Peak Meter");
+			break;
+		case 5:
+			snd_ctl_elem_id_set_name(id, "Playback RMS Meter");
+			break;
+		case 6:
+			snd_ctl_elem_id_set_name(id, "Capture Peak Meter");
+			break;
+		case 7:
+			snd_ctl_elem_id_set_name(id, "Capture RMS Meter");
+			break;
+		case 8:
+			snd_ctl_elem_id_set_name(id, "Call Playback Switch");
+			break;
+		case 9:
+			snd_ctl_elem_id_set_name(id, "Call Capture Switch");
+			break;
+		case 10:
+			snd_ctl_elem_id_set_name(id, "Call Setup");
+			break;
 	}			
 	
 	return 0;
@@ -92,23 +269,66 @@ static int android_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_el
 
 static int android_elem_count(snd_ctl_ext_t *ext)
 {
-	return CTL_ANDROID_COUNT;
+	snd_ctl_android_t *android = ext->private_data;
+	int slot, count=CTL_ANDROID_COUNT;
+
+	pthread_mutex_lock(&android->streams_lock);
+	for(slot=0; slot<SHARED_STREAM_SLOTS; slot++){
+		if(android->streams[slot].pid)
+			count+=2;
+	}
+	pthread_mutex_unlock(&android->streams_lock);
+
+	return count;
 }
 
 static snd_ctl_ext_key_t android_find_elem(snd_ctl_ext_t *ext, const snd_ctl_elem_id_t *id)
 {
-	unsigned int numid;
+	snd_ctl_android_t *android = ext->private_data;
+	snd_ctl_elem_id_t *stream_id;
+	unsigned int numid, slot;
+	snd_ctl_ext_key_t key;
 
 	numid = snd_ctl_elem_id_get_numid(id);
-	if(numid>3)
+	if(numid>CTL_ANDROID_COUNT)
+		return android_stream_key(android, numid - 1);
+	if(numid)
+		return numid;
+
+	// Looked up by name, as amixer cset name=... does: the fixed elements first
+	snd_ctl_elem_id_alloca(&stream_id);
+	slot=snd_ctl_elem_id_get_index(id);
+	if(slot==0){
+		for(key=1; key<=CTL_ANDROID_COUNT; key++){
+			android_elem_list(ext, key - 1, stream_id);
+			if(!strcmp(snd_ctl_elem_id_get_name(stream_id), snd_ctl_elem_id_get_name(id)))
+				return key;
+		}
+	}
+
+	// The index of a stream element is the registry slot
+	if(slot>=SHARED_STREAM_SLOTS || !android->streams[slot].pid)
 		return SND_CTL_EXT_KEY_NOT_FOUND;
-	
-	return numid;
+
+	for(key=CTL_ANDROID_STREAM + 2 * slot; key<=CTL_ANDROID_STREAM + 2 * slot + 1; key++){
+		android_stream_id(android, key, stream_id);
+		if(!strcmp(snd_ctl_elem_id_get_name(stream_id), snd_ctl_elem_id_get_name(id)))
+			return key;
+	}
+	return SND_CTL_EXT_KEY_NOT_FOUND;
 }
 
 static int android_get_attribute(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
 			     int *type, unsigned int *acc, unsigned int *count)
 {
+	if(key>=CTL_ANDROID_STREAM){
+		// Per stream volume in percent and its switch, on when not muted
+		*type = CTL_ANDROID_STREAM_MUTE(key) ? SND_CTL_ELEM_TYPE_BOOLEAN : SND_CTL_ELEM_TYPE_INTEGER;
+		*count = 1;
+		*acc = SND_CTL_EXT_ACCESS_READWRITE;
+		return 0;
+	}
+
 	switch(key){
 		case CTL_ANDROID_VOLUME:
 			// Master volume
@@ -125,44 +345,136 @@ static int android_get_attribute(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
 			*type = SND_CTL_ELEM_TYPE_BOOLEAN;
 			*count = 1;
 			break;
+		case CTL_ANDROID_EAR:
+		case CTL_ANDROID_MIC:
+			// Earpiece and microphone of the route, on when not muted
+			*type = SND_CTL_ELEM_TYPE_BOOLEAN;
+			*count = 1;
+			break;
+		case CTL_ANDROID_CALL:
+			// Route, earpiece switch, microphone switch and volume at once
+			*type = SND_CTL_ELEM_TYPE_INTEGER;
+			*count = CTL_ANDROID_CALL_COUNT;
+			break;
+		case CTL_ANDROID_DUPLEX_LATENCY:
+			// Measured playback to capture latency in microseconds
+			*type = SND_CTL_ELEM_TYPE_INTEGER;
+			*count = 1;
+			*acc = SND_CTL_EXT_ACCESS_READ | SND_CTL_EXT_ACCESS_VOLATILE;
+			return 0;
+		case CTL_ANDROID_PLAYBACK_PEAK:
+		case CTL_ANDROID_PLAYBACK_RMS:
+		case CTL_ANDROID_CAPTURE_PEAK:
+		case CTL_ANDROID_CAPTURE_RMS:
+			// Level of the last transfer, in sample units
+			*type = SND_CTL_ELEM_TYPE_INTEGER;
+			*count = 1;
+			*acc = SND_CTL_EXT_ACCESS_READ | SND_CTL_EXT_ACCESS_VOLATILE;
+			return 0;
 	}
 	*acc = SND_CTL_EXT_ACCESS_READWRITE;
 
 	return 0;
 }
 
-static int android_get_integer_info(snd_ctl_ext_t *ext ATTRIBUTE_UNUSED,
-				snd_ctl_ext_key_t key ATTRIBUTE_UNUSED,
+static int android_get_integer_info(snd_ctl_ext_t *ext,
+				snd_ctl_ext_key_t key,
 				long *imin, long *imax, long *istep)
 {
+	snd_ctl_android_t *android = ext->private_data;
+
 	*istep = 0;
 	*imin = 0;
-	*imax = 5;
+	*imax = CTL_ANDROID_VOLUME_MAX;
+	if(key>=CTL_ANDROID_STREAM){
+		*imax = 100;
+		return 0;
+	}
+	switch(key){
+		case CTL_ANDROID_DUPLEX_LATENCY:
+			*imax = 1000000;
+			break;
+		case CTL_ANDROID_CALL:
+			// One range for all values, wide enough for the route index
+			if(android->end_point_count - 1 > *imax)
+				*imax = android->end_point_count - 1;
+			break;
+		case CTL_ANDROID_PLAYBACK_PEAK:
+		case CTL_ANDROID_PLAYBACK_RMS:
+		case CTL_ANDROID_CAPTURE_PEAK:
+		case CTL_ANDROID_CAPTURE_RMS:
+			*imax = 32767;
+			break;
+	}
 	return 0;
 }
 
 static int android_write_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value)
 {
+	snd_ctl_android_t *android = ext->private_data;
+	struct shared_call_state call;
 	int ret=-1;
 
+	if(key>=CTL_ANDROID_STREAM){
+		TRACE_MARK("ctl_write_stream", key);
+		if(CTL_ANDROID_STREAM_MUTE(key))
+			return shared_stream_set_mute(CTL_ANDROID_STREAM_SLOT(key), !*value);
+		return shared_stream_set_volume(CTL_ANDROID_STREAM_SLOT(key), *value);
+	}
+
 	switch(key){
 		case CTL_ANDROID_VOLUME:
-			ret=shared_props_set_volume(*value);
-			break;
+			TRACE_MARK("ctl_write_volume", *value);
+			call.volume=*value;
+			return android_set_call(android, &call, SHARED_CALL_VOLUME, 0);
 		case CTL_ANDROID_REC:
-			ret=shared_props_set_rec_flag(*value);
-			break;
+			TRACE_MARK("ctl_write_rec", *value);
+			return shared_props_set_rec_flag(*value);
+		case CTL_ANDROID_EAR:
+		case CTL_ANDROID_MIC:
+			TRACE_MARK(key==CTL_ANDROID_EAR ? "ctl_write_ear" : "ctl_write_mic", *value);
+			// The other mute is kept from the published state
+			ret=shared_props_get_call(&call, NULL);
+			if(ret)
+				return ret;
+			if(key==CTL_ANDROID_EAR)
+				call.ear_mute=!*value;
+			else
+				call.mic_mute=!*value;
+			return android_set_call(android, &call, SHARED_CALL_MUTE, 0);
+		case CTL_ANDROID_CALL:
+			// The element shares one range, each value is checked against its own
+			if(value[CTL_ANDROID_CALL_ROUTE]<0 ||
+			   value[CTL_ANDROID_CALL_ROUTE]>=android->end_point_count ||
+			   value[CTL_ANDROID_CALL_EAR]<0 || value[CTL_ANDROID_CALL_EAR]>1 ||
+			   value[CTL_ANDROID_CALL_MIC]<0 || value[CTL_ANDROID_CALL_MIC]>1 ||
+			   value[CTL_ANDROID_CALL_VOLUME]<0 ||
+			   value[CTL_ANDROID_CALL_VOLUME]>CTL_ANDROID_VOLUME_MAX)
+				return -EINVAL;
+			call.route=value[CTL_ANDROID_CALL_ROUTE];
+			call.route_id=android->end_point_list[call.route].id;
+			call.ear_mute=!value[CTL_ANDROID_CALL_EAR];
+			call.mic_mute=!value[CTL_ANDROID_CALL_MIC];
+			call.volume=value[CTL_ANDROID_CALL_VOLUME];
+			TRACE_MARK("ctl_write_call", call.route_id);
+			return android_set_call(android, &call,
+			                        SHARED_CALL_ROUTE | SHARED_CALL_MUTE | SHARED_CALL_VOLUME, 0);
 	}
-	
-	if(ret)
-		return ret;
-	
-	return set_volume_rpc(*value);
+
+	return ret;
 }
 
 static int android_read_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value)
 {
+	struct shared_call_state call;
 	int ret=-1;
+	long peak, rms, volume, mute;
+
+	if(key>=CTL_ANDROID_STREAM){
+		ret=shared_stream_get_gain(CTL_ANDROID_STREAM_SLOT(key), &volume, &mute);
+		*value=CTL_ANDROID_STREAM_MUTE(key) ? !mute : volume;
+		return ret;
+	}
 	
 	switch(key){
 		case CTL_ANDROID_VOLUME:
@@ -171,6 +483,31 @@ static int android_read_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long
 		case CTL_ANDROID_REC:
 			ret=shared_props_get_rec_flag(value);
 			break;
+		case CTL_ANDROID_DUPLEX_LATENCY:
+			ret=shared_props_get_duplex_latency(value);
+			break;
+		case CTL_ANDROID_EAR:
+		case CTL_ANDROID_MIC:
+			ret=shared_props_get_call(&call, NULL);
+			*value=!(key==CTL_ANDROID_EAR ? call.ear_mute : call.mic_mute);
+			break;
+		case CTL_ANDROID_CALL:
+			ret=shared_props_get_call(&call, NULL);
+			value[CTL_ANDROID_CALL_ROUTE]=call.route;
+			value[CTL_ANDROID_CALL_EAR]=!call.ear_mute;
+			value[CTL_ANDROID_CALL_MIC]=!call.mic_mute;
+			value[CTL_ANDROID_CALL_VOLUME]=call.volume;
+			break;
+		case CTL_ANDROID_PLAYBACK_PEAK:
+		case CTL_ANDROID_PLAYBACK_RMS:
+			ret=shared_props_get_levels(SND_PCM_STREAM_PLAYBACK, &peak, &rms);
+			*value=key==CTL_ANDROID_PLAYBACK_PEAK ? peak : rms;
+			break;
+		case CTL_ANDROID_CAPTURE_PEAK:
+		case CTL_ANDROID_CAPTURE_RMS:
+			ret=shared_props_get_levels(SND_PCM_STREAM_CAPTURE, &peak, &rms);
+			*value=key==CTL_ANDROID_CAPTURE_PEAK ? peak : rms;
+			break;
 	}
 
 	return ret;
@@ -200,18 +537,86 @@ static int android_get_enumerated_name(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key
 	return 0;
 }
 
+static int android_set_route(snd_ctl_android_t *android, unsigned int item)
+{
+	struct shared_call_state call;
+
+	if (item >= android->end_point_count)
+		return -EINVAL;
+
+	call.route=item;
+	call.route_id=android->end_point_list[item].id;
+
+	TRACE_MARK("ctl_write_route", call.route_id);
+
+	// Selecting a route always routes, even to the current one
+	return android_set_call(android, &call, SHARED_CALL_ROUTE, SHARED_CALL_ROUTE);
+}
+
 static int android_write_enumerated(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key ATTRIBUTE_UNUSED,	unsigned int *items)
 {
 	snd_ctl_android_t *android = ext->private_data;
 
-	int id=android->end_point_list[*items].id;
+	return android_set_route(android, *items);
+}
 
-	int ret=shared_props_set_route(*items);
-	if(ret)
-		return ret;
-	shared_props_set_route_id(id);
-	
-	return do_route_audio_rpc(id,SND_MUTE_MUTED,SND_MUTE_MUTED);
+/*
+ 	Called by the hotplug watcher when the headset switch changes. Plugging
+ 	routes to the headset endpoint, unplugging restores the previous route.
+ 	The state applied and the route to restore are shared, so a watcher
+ 	taking over from a dead owner carries on from them.
+ */
+static void android_hotplug(void *arg, int state)
+{
+	snd_ctl_android_t *android=(snd_ctl_android_t *)arg;
+	unsigned int route;
+	int i, restore=-1;
+
+	shared_hotplug_get(NULL, &restore);
+
+	if(!state){
+		if(restore>=0)
+			android_set_route(android, restore);
+		shared_hotplug_set(state, -1);
+		return;
+	}
+
+	for(i=0; i<android->end_point_count; i++){
+		if(!strcmp(android->end_point_list[i].name, android->hotplug_headset))
+			break;
+	}
+	if(i==android->end_point_count){
+		SNDERR("No endpoint named %s for the headset", android->hotplug_headset);
+		shared_hotplug_set(state, restore);
+		return;
+	}
+
+	if(!shared_props_get_route(&route) && route!=i)
+		restore=route;
+	android_set_route(android, i);
+	shared_hotplug_set(state, restore);
+}
+
+/*
+ 	Starts the headset watcher unless another control instance of the
+ 	system runs one. It starts from the last state applied, so opening a
+ 	control does not route again while the jack did not change.
+ */
+static void android_hotplug_claim(snd_ctl_android_t *android)
+{
+	int state=-1, err;
+
+	if(!shared_hotplug_claim())
+		return;
+
+	shared_hotplug_get(&state, NULL);
+	err=hotplug_start(&android->hotplug, android->hotplug_switch, android->hotplug_uevent,
+	                  state, android_hotplug, android);
+	if(err<0){
+		SNDERR("Headset hotplug watcher failed to start: %s", strerror(-err));
+		shared_hotplug_release();
+		android->hotplug_enabled=0;
+	}
 }
 
 static int android_read_enumerated(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key ATTRIBUTE_UNUSED, unsigned int *items)
@@ -223,7 +628,18 @@ static void android_close(snd_ctl_ext_t *ext)
 {
 	snd_ctl_android_t *android = ext->private_data;
 
+	// The monitor thread may start the watcher, it is stopped first
 	pthread_cancel(android->monitor_thread);
+	pthread_join(android->monitor_thread, NULL);
+	if(android->hotplug){
+		hotplug_stop(android->hotplug);
+		shared_hotplug_release();
+	}
+	free(android->hotplug_switch);
+	free(android->hotplug_uevent);
+	free(android->hotplug_headset);
+	pthread_mutex_destroy(&android->streams_lock);
+	pthread_mutex_destroy(&android->route_lock);
 	close(android->ext.poll_fd);
 	close(android->push_fd);
 	if(android && android->end_point_list)
@@ -239,14 +655,74 @@ static int android_read_event(snd_ctl_ext_t *ext,
 {
 	int i;
 	int ret=read(ext->poll_fd, &i, sizeof(int));
-	if(ret==sizeof(int)){
+	if(ret!=sizeof(int))
+		return ret;
+
+	*event_mask = SND_CTL_EVENT_MASK_VALUE;
+	if(i & CTL_ANDROID_EVENT_ADD)
+		*event_mask |= SND_CTL_EVENT_MASK_ADD | SND_CTL_EVENT_MASK_INFO;
+	if(i & CTL_ANDROID_EVENT_REMOVE)
+		*event_mask = SND_CTL_EVENT_MASK_REMOVE;
+	i &= ~(CTL_ANDROID_EVENT_ADD | CTL_ANDROID_EVENT_REMOVE);
+
+	if(i>=CTL_ANDROID_STREAM)
+		android_stream_id(ext->private_data, i, id);
+	else
 		android_elem_list(ext, i, id);
-		*event_mask = SND_CTL_EVENT_MASK_VALUE;
-	}
 
 	return ret;
 }
 
+static void android_monitor_push(snd_ctl_android_t *android, int control, long value, long *old)
+{
+	if(value==*old)
+		return;
+	*old=value;
+	write(android->push_fd, &control, sizeof(control));
+}
+
+/*
+ 	Takes in the streams registered and gone since the last scan. With push
+ 	set, their elements are announced as added or removed.
+ */
+static void android_streams_scan(snd_ctl_android_t *android, int push)
+{
+	int slot, pid, stream, key;
+	char name[SHARED_STREAM_NAME_MAX];
+
+	for(slot=0; slot<SHARED_STREAM_SLOTS; slot++){
+		if(shared_stream_get(slot, &pid, &stream, name, sizeof(name)))
+			pid=0;
+		if(pid==android->streams[slot].pid)
+			continue;
+
+		key=CTL_ANDROID_STREAM + 2 * slot;
+		if(push && android->streams[slot].pid){
+			key|=CTL_ANDROID_EVENT_REMOVE;
+			write(android->push_fd, &key, sizeof(key));
+			key++;
+			write(android->push_fd, &key, sizeof(key));
+			key=CTL_ANDROID_STREAM + 2 * slot;
+		}
+
+		// A gone stream keeps its name for the remove events
+		pthread_mutex_lock(&android->streams_lock);
+		android->streams[slot].pid=pid;
+		if(pid){
+			android->streams[slot].stream=stream;
+			strcpy(android->streams[slot].name, name);
+		}
+		pthread_mutex_unlock(&android->streams_lock);
+
+		if(push && pid){
+			key|=CTL_ANDROID_EVENT_ADD;
+			write(android->push_fd, &key, sizeof(key));
+			key++;
+			write(android->push_fd, &key, sizeof(key));
+		}
+	}
+}
+
 // Monitor changes in the values. It is running in a seperate thread
 void *android_monitor(void *arg)
 {
@@ -254,24 +730,95 @@ void *android_monitor(void *arg)
 	long old_volume=0;
 	unsigned int old_route=0;
 	long volume=0;
-	unsigned int route=0;
-	int control;
+	long old_latency=0;
+	long latency=0;
+	long old_rec=0;
+	long rec=0;
+	long old_levels[4]={0, 0, 0, 0};
+	long old_mutes[2]={1, 1};
+	struct shared_call_state call;
+	int seq, old_seq=-1;
+	long old_gain[SHARED_STREAM_SLOTS][2];
+	long peak, rms, mute;
+	int control, slot, changes, cancel_state;
+	long timeout;
+
+	for(slot=0; slot<SHARED_STREAM_SLOTS; slot++){
+		old_gain[slot][0]=-1;
+		old_gain[slot][1]=-1;
+	}
 
+	/*
+	 	Control changes wake the thread at once, the meters and latency
+	 	are sampled at the period. While the meters read silence and no
+	 	headset watcher is to be taken over there is nothing to sample,
+	 	the first level after silence wakes the thread.
+	 */
+	changes=shared_props_changes();
 	while(1){
-		sleep(2);
-		if(!shared_props_get_volume(&volume)){
-			if(volume!=old_volume){
-				old_volume=volume;
+		timeout=MONITOR_PERIOD_US;
+		if(!old_levels[0] && !old_levels[1] && !old_levels[2] && !old_levels[3] &&
+		   !(android->hotplug_enabled && !android->hotplug))
+			timeout=-1;
+		shared_props_wait_change(changes, timeout);
+		// The futex wait is not a cancellation point
+		pthread_testcancel();
+		changes=shared_props_changes();
+
+		// Takes over the headset watcher of a control that went away
+		if(android->hotplug_enabled && !android->hotplug){
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+			android_hotplug_claim(android);
+			pthread_setcancelstate(cancel_state, NULL);
+		}
+		if(!shared_props_get_call(&call, &seq) && seq!=old_seq){
+			old_seq=seq;
+			if(call.volume!=old_volume){
+				old_volume=call.volume;
 				control=0;
 				write(android->push_fd, &control, sizeof(control));
 			}
-		}
-		if(!shared_props_get_route(&route)){
-			if(route!=old_route){
-				old_route=route;
+			if(call.route!=old_route){
+				old_route=call.route;
 				control=1;
 				write(android->push_fd, &control, sizeof(control));
 			}
+			android_monitor_push(android, 8, call.ear_mute, &old_mutes[0]);
+			android_monitor_push(android, 9, call.mic_mute, &old_mutes[1]);
+			// The whole call setup once per transaction
+			control=10;
+			write(android->push_fd, &control, sizeof(control));
+		}
+		if(!shared_props_get_rec_flag(&rec)){
+			if(rec!=old_rec){
+				old_rec=rec;
+				control=2;
+				write(android->push_fd, &control, sizeof(control));
+			}
+		}
+		if(!shared_props_get_duplex_latency(&latency)){
+			if(latency!=old_latency){
+				old_latency=latency;
+				control=3;
+				write(android->push_fd, &control, sizeof(control));
+			}
+		}
+		if(!shared_props_get_levels(SND_PCM_STREAM_PLAYBACK, &peak, &rms)){
+			android_monitor_push(android, 4, peak, &old_levels[0]);
+			android_monitor_push(android, 5, rms, &old_levels[1]);
+		}
+		if(!shared_props_get_levels(SND_PCM_STREAM_CAPTURE, &peak, &rms)){
+			android_monitor_push(android, 6, peak, &old_levels[2]);
+			android_monitor_push(android, 7, rms, &old_levels[3]);
+		}
+
+		android_streams_scan(android, 1);
+		for(slot=0; slot<SHARED_STREAM_SLOTS; slot++){
+			if(!android->streams[slot].pid ||
+			   shared_stream_get_gain(slot, &volume, &mute))
+				continue;
+			android_monitor_push(android, CTL_ANDROID_STREAM + 2 * slot, volume, &old_gain[slot][0]);
+			android_monitor_push(android, CTL_ANDROID_STREAM + 2 * slot + 1, mute, &old_gain[slot][1]);
 		}
 	}
 }
@@ -299,6 +846,10 @@ SND_CTL_PLUGIN_DEFINE_FUNC(alsa_android)
 	int err, fd=-1, i;
 	snd_ctl_android_t *android=0;
 	int pipes[2];
+	int hotplug=0;
+	const char *hotplug_switch="/sys/class/switch/h2w";
+	const char *hotplug_uevent=NULL;
+	const char *hotplug_headset="HEADSET";
 
 	snd_config_for_each(it, next, conf) {
 		snd_config_t *n = snd_config_iterator_entry(it);
@@ -307,6 +858,34 @@ SND_CTL_PLUGIN_DEFINE_FUNC(alsa_android)
 			continue;
 		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
 			continue;
+		if (strcmp(id, "hotplug") == 0) {
+			if ((hotplug = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "hotplug_switch") == 0) {
+			if (snd_config_get_string(n, &hotplug_switch) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "hotplug_uevent") == 0) {
+			if (snd_config_get_string(n, &hotplug_uevent) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "hotplug_headset") == 0) {
+			if (snd_config_get_string(n, &hotplug_headset) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
 	}
@@ -328,7 +907,11 @@ SND_CTL_PLUGIN_DEFINE_FUNC(alsa_android)
 	android->ext.callback = &android_ext_callback;
 	android->ext.private_data = android;
 
-	fd = open ("/dev/msm_snd", O_RDWR);
+	pthread_mutex_init(&android->streams_lock, NULL);
+	pthread_mutex_init(&android->route_lock, NULL);
+	android_streams_scan(android, 0);
+
+	fd = snd_control_open();
 	if(fd==-1){
 		SNDERR("Error opening file /dev/msm_snd\n");
 		err=errno;
@@ -352,12 +935,19 @@ SND_CTL_PLUGIN_DEFINE_FUNC(alsa_android)
 			goto error;
 		}
 	}
-	close(fd);
 
 	err = snd_ctl_ext_create(&android->ext, name, mode);
 	if (err < 0)
 		goto error;
 
+	if(hotplug){
+		android->hotplug_enabled=1;
+		android->hotplug_switch=strdup(hotplug_switch);
+		android->hotplug_uevent=hotplug_uevent ? strdup(hotplug_uevent) : NULL;
+		android->hotplug_headset=strdup(hotplug_headset);
+		android_hotplug_claim(android);
+	}
+
 	pthread_create(&android->monitor_thread, NULL, android_monitor, android);
 	
 	*handlep = android->ext.handle;
@@ -366,8 +956,6 @@ SND_CTL_PLUGIN_DEFINE_FUNC(alsa_android)
 error:
 	close(pipes[0]);
 	close(pipes[1]);
-	if(fd>-1)
-		close(fd);
 	if(android && android->end_point_list)
 		free(android->end_point_list);
 	if(android)
@@ -0,0 +1,167 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "drift.h"
+
+// The fill level is averaged this long before it becomes the setpoint
+#define DRIFT_SETTLE_MS	1000
+// Time constant of the fill level filter
+#define DRIFT_FILTER_MS	500
+// Gains on the fill error in seconds
+#define DRIFT_KP	0.02
+#define DRIFT_KI	0.002
+// Largest correction, beyond any crystal tolerance
+#define DRIFT_MAX_PPM	2000
+
+struct drift {
+	unsigned int rate;
+	unsigned int channels;
+
+	// Controller
+	unsigned long settled;	// frames measured before the setpoint was taken
+	double fill;		// filtered fill level in frames
+	double target;
+	double integral;	// seconds of error times seconds
+	double ratio;		// input frames consumed per output frame
+
+	// Resampler, the output lies phase frames past the last input frame
+	double phase;
+	int16_t last[DSP_MAX_CHANNELS];
+};
+
+struct drift *drift_new(unsigned int rate, unsigned int channels)
+{
+	struct drift *drift;
+
+	if(channels>DSP_MAX_CHANNELS)
+		return NULL;
+
+	drift=calloc(1, sizeof(*drift));
+	if(!drift)
+		return NULL;
+
+	drift->rate=rate;
+	drift->channels=channels;
+	drift_reset(drift);
+	return drift;
+}
+
+void drift_free(struct drift *drift)
+{
+	free(drift);
+}
+
+void drift_reset(struct drift *drift)
+{
+	drift->settled=0;
+	drift->fill=0;
+	drift->target=0;
+	drift->integral=0;
+	drift->ratio=1.0;
+	// The first input frame is output as is
+	drift->phase=1.0;
+	memset(drift->last, 0, sizeof(drift->last));
+}
+
+/*
+ 	Feeds the buffer fill measured before moving frames more frames. The
+ 	first second only establishes the level to hold.
+ */
+void drift_update(struct drift *drift, long fill, unsigned int frames)
+{
+	double settle=(double)drift->rate * DRIFT_SETTLE_MS / 1000;
+	double alpha, error, dt, limit, ppm;
+
+	if(drift->settled<settle){
+		drift->settled+=frames;
+		drift->fill+=(fill - drift->fill) * frames / (double)drift->settled;
+		if(drift->settled>=settle)
+			drift->target=drift->fill;
+		return;
+	}
+
+	alpha=frames * 1000.0 / (drift->rate * (double)DRIFT_FILTER_MS);
+	if(alpha>1)
+		alpha=1;
+	drift->fill+=(fill - drift->fill) * alpha;
+
+	dt=(double)frames / drift->rate;
+	error=(drift->fill - drift->target) / drift->rate;
+
+	// The integral alone may not ask for more than the limit
+	limit=DRIFT_MAX_PPM * 1e-6 / DRIFT_KI;
+	drift->integral+=error * dt;
+	if(drift->integral>limit)
+		drift->integral=limit;
+	else if(drift->integral<-limit)
+		drift->integral=-limit;
+
+	ppm=(DRIFT_KP * error + DRIFT_KI * drift->integral) * 1e6;
+	if(ppm>DRIFT_MAX_PPM)
+		ppm=DRIFT_MAX_PPM;
+	else if(ppm<-DRIFT_MAX_PPM)
+		ppm=-DRIFT_MAX_PPM;
+	drift->ratio=1.0 + ppm * 1e-6;
+}
+
+// Current correction, positive when the input is consumed faster than played
+long drift_ppm(struct drift *drift)
+{
+	return (long)((drift->ratio - 1.0) * 1e6);
+}
+
+/*
+ 	Resamples all of the input, as long as the output has room for it.
+ 	Returns the number of output frames.
+ */
+unsigned int drift_process(struct drift *drift, const int16_t *in, unsigned int in_frames,
+                           int16_t *out, unsigned int out_frames)
+{
+	unsigned int ch=drift->channels, i=0, n=0, c;
+	double phase=drift->phase;
+
+	while(n<out_frames){
+		while(phase>=1.0 && i<in_frames){
+			for(c=0; c<ch; c++)
+				drift->last[c]=in[i * ch + c];
+			i++;
+			phase-=1.0;
+		}
+		if(i>=in_frames)
+			break;
+
+		for(c=0; c<ch; c++)
+			out[n * ch + c]=(int16_t)(drift->last[c] + (in[i * ch + c] - drift->last[c]) * phase);
+		n++;
+		phase+=drift->ratio;
+	}
+
+	// Out of room: the rest of the input is dropped, the callers size the output to avoid it
+	if(i<in_frames){
+		for(c=0; c<ch; c++)
+			drift->last[c]=in[(in_frames - 1) * ch + c];
+		phase=0;
+	}
+	drift->phase=phase;
+
+	return n;
+}
@@ -0,0 +1,39 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#include <stdint.h>
+
+/*
+ 	Clock drift compensation: a PI controller holds the buffer fill at the
+ 	level found when the stream settled, by steering the ratio of a linear
+ 	interpolating resampler a few hundred ppm around 1.
+ */
+struct drift;
+
+struct drift *drift_new(unsigned int rate, unsigned int channels);
+void drift_free(struct drift *drift);
+void drift_reset(struct drift *drift);
+void drift_update(struct drift *drift, long fill, unsigned int frames);
+long drift_ppm(struct drift *drift);
+unsigned int drift_process(struct drift *drift, const int16_t *in, unsigned int in_frames,
+                           int16_t *out, unsigned int out_frames);
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "dsp.h"
+
+typedef float v4sf __attribute__ ((vector_size (16)));
+
+typedef int v4si __attribute__ ((vector_size (16)));
+
+typedef union {
+	v4sf v;
+	float f[4];
+} v4sf_u;
+
+typedef union {
+	v4si v;
+	int i[4];
+} v4si_u;
+
+// Unaligned loads and stores, the compiler turns them into vector moves
+static inline v4sf load4(const float *p)
+{
+	v4sf v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store4(float *p, v4sf v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+// Clips to the S16 range instead of wrapping around
+static inline int16_t dsp_saturate(float v)
+{
+	if(v>32767.0f)
+		return 32767;
+	if(v<-32768.0f)
+		return -32768;
+	return (int16_t)v;
+}
+
+float dsp_dot(const float *a, const float *b, unsigned int n)
+{
+	v4sf_u acc;
+	unsigned int i;
+	float sum;
+
+	acc.v=(v4sf){0, 0, 0, 0};
+	for(i=0; i+4<=n; i+=4)
+		acc.v+=load4(a + i) * load4(b + i);
+
+	sum=acc.f[0] + acc.f[1] + acc.f[2] + acc.f[3];
+	for(; i<n; i++)
+		sum+=a[i] * b[i];
+
+	return sum;
+}
+
+void dsp_axpy(float *y, float a, const float *x, unsigned int n)
+{
+	v4sf va={a, a, a, a};
+	unsigned int i;
+
+	for(i=0; i+4<=n; i+=4)
+		store4(y + i, load4(y + i) + va * load4(x + i));
+
+	for(; i<n; i++)
+		y[i]+=a * x[i];
+}
+
+// y[i] *= x[i], for windows and spectral gains
+void dsp_mul(float *y, const float *x, unsigned int n)
+{
+	unsigned int i;
+
+	for(i=0; i+4<=n; i+=4)
+		store4(y + i, load4(y + i) * load4(x + i));
+
+	for(; i<n; i++)
+		y[i]*=x[i];
+}
+
+// Squared magnitude of complex values
+void dsp_power(const float *re, const float *im, float *out, unsigned int n)
+{
+	unsigned int i;
+	v4sf r, m;
+
+	for(i=0; i+4<=n; i+=4){
+		r=load4(re + i);
+		m=load4(im + i);
+		store4(out + i, r * r + m * m);
+	}
+
+	for(; i<n; i++)
+		out[i]=re[i] * re[i] + im[i] * im[i];
+}
+
+/*
+ 	In place radix 2 FFT of n points, n a power of 2. The tables hold
+ 	cos and sin of 2*pi*k/n for k < n/2. The inverse is not scaled.
+ */
+void dsp_fft(float *re, float *im, const float *cos_tab, const float *sin_tab,
+             unsigned int n, int inverse)
+{
+	unsigned int i, j, k, len, half, step;
+	float t, wr, wi, xr, xi;
+
+	for(i=1, j=0; i<n; i++){
+		unsigned int bit=n >> 1;
+		for(; j & bit; bit>>=1)
+			j^=bit;
+		j^=bit;
+		if(i<j){
+			t=re[i]; re[i]=re[j]; re[j]=t;
+			t=im[i]; im[i]=im[j]; im[j]=t;
+		}
+	}
+
+	for(len=2; len<=n; len<<=1){
+		half=len >> 1;
+		step=n / len;
+		for(i=0; i<n; i+=len){
+			for(k=0; k<half; k++){
+				wr=cos_tab[k * step];
+				wi=inverse ? sin_tab[k * step] : -sin_tab[k * step];
+				xr=re[i + k + half] * wr - im[i + k + half] * wi;
+				xi=re[i + k + half] * wi + im[i + k + half] * wr;
+				re[i + k + half]=re[i + k] - xr;
+				im[i + k + half]=im[i + k] - xi;
+				re[i + k]+=xr;
+				im[i + k]+=xi;
+			}
+		}
+	}
+}
+
+void dsp_s16_to_float(const int16_t *in, float *out, unsigned int n)
+{
+	v4sf scale={1.0f / 32768, 1.0f / 32768, 1.0f / 32768, 1.0f / 32768};
+	unsigned int i;
+
+	for(i=0; i+4<=n; i+=4)
+		store4(out + i, (v4sf){in[i], in[i + 1], in[i + 2], in[i + 3]} * scale);
+
+	for(; i<n; i++)
+		out[i]=in[i] / 32768.0f;
+}
+
+void dsp_float_to_s16(const float *in, int16_t *out, unsigned int n)
+{
+	unsigned int i;
+	float v;
+
+	for(i=0; i<n; i++){
+		v=in[i] * 32768.0f;
+		if(v>32767.0f)
+			v=32767.0f;
+		else if(v<-32768.0f)
+			v=-32768.0f;
+		out[i]=(int16_t)v;
+	}
+}
+
+void dsp_biquad(struct dsp_biquad *bq, float *buf, unsigned int frames, unsigned int channels)
+{
+	unsigned int i, c;
+	float x, y;
+
+	// The recursion runs along time, the channels of one frame are independent
+	for(c=0; c<channels; c++){
+		float z1=bq->z1[c], z2=bq->z2[c];
+
+		for(i=0; i<frames; i++){
+			x=buf[i * channels + c];
+			y=bq->b0 * x + z1;
+			z1=bq->b1 * x - bq->a1 * y + z2;
+			z2=bq->b2 * x - bq->a2 * y;
+			buf[i * channels + c]=y;
+		}
+
+		bq->z1[c]=z1;
+		bq->z2[c]=z2;
+	}
+}
+
+// Mean square of the samples, full scale is 1.0
+float dsp_mean_square_s16(const int16_t *buf, unsigned int n)
+{
+	v4sf_u acc;
+	v4sf v;
+	unsigned int i;
+	float sum;
+
+	if(!n)
+		return 0;
+
+	acc.v=(v4sf){0, 0, 0, 0};
+	for(i=0; i+4<=n; i+=4){
+		v=(v4sf){buf[i], buf[i + 1], buf[i + 2], buf[i + 3]};
+		acc.v+=v * v;
+	}
+
+	sum=acc.f[0] + acc.f[1] + acc.f[2] + acc.f[3];
+	for(; i<n; i++)
+		sum+=(float)buf[i] * buf[i];
+
+	return sum / (32768.0f * 32768.0f * n);
+}
+
+// Peak absolute sample and mean square in a single pass
+void dsp_levels_s16(const int16_t *buf, unsigned int n, int *peak, float *mean_square)
+{
+	v4sf_u acc;
+	v4si_u max;
+	v4si x, sign, gt;
+	unsigned int i;
+	float sum;
+	int m, a;
+
+	acc.v=(v4sf){0, 0, 0, 0};
+	max.v=(v4si){0, 0, 0, 0};
+	for(i=0; i+4<=n; i+=4){
+		x=(v4si){buf[i], buf[i + 1], buf[i + 2], buf[i + 3]};
+		acc.v+=(v4sf){buf[i], buf[i + 1], buf[i + 2], buf[i + 3]} *
+		       (v4sf){buf[i], buf[i + 1], buf[i + 2], buf[i + 3]};
+		sign=x >> 31;
+		x=(x ^ sign) - sign;
+		gt=x > max.v;
+		max.v=(x & gt) | (max.v & ~gt);
+	}
+
+	sum=acc.f[0] + acc.f[1] + acc.f[2] + acc.f[3];
+	m=max.i[0];
+	for(a=1; a<4; a++)
+		if(max.i[a]>m)
+			m=max.i[a];
+	for(; i<n; i++){
+		sum+=(float)buf[i] * buf[i];
+		a=buf[i]<0 ? -buf[i] : buf[i];
+		if(a>m)
+			m=a;
+	}
+
+	*peak=m>32767 ? 32767 : m;
+	*mean_square=n ? sum / (32768.0f * 32768.0f * n) : 0;
+}
+
+// Scales n samples by a constant gain with saturation, in and out may be the same buffer
+void dsp_gain_s16(const int16_t *in, int16_t *out, unsigned int n, float gain)
+{
+	v4sf_u x;
+	unsigned int i;
+
+	for(i=0; i+4<=n; i+=4){
+		x.v=(v4sf){in[i], in[i + 1], in[i + 2], in[i + 3]} * gain;
+		out[i]=dsp_saturate(x.f[0]);
+		out[i + 1]=dsp_saturate(x.f[1]);
+		out[i + 2]=dsp_saturate(x.f[2]);
+		out[i + 3]=dsp_saturate(x.f[3]);
+	}
+	for(; i<n; i++)
+		out[i]=dsp_saturate(in[i] * gain);
+}
+
+/*
+ 	Scales the frames by a gain moving by step per frame and held within
+ 	0..1, for fades. Returns the gain reached after the last frame.
+ */
+float dsp_ramp_s16(int16_t *buf, unsigned int frames, unsigned int channels, float gain, float step)
+{
+	unsigned int i, c;
+
+	for(i=0; i<frames; i++){
+		gain+=step;
+		if(gain<0)
+			gain=0;
+		else if(gain>1)
+			gain=1;
+		for(c=0; c<channels; c++)
+			buf[i * channels + c]=(int16_t)(buf[i * channels + c] * gain);
+	}
+	return gain;
+}
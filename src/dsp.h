@@ -0,0 +1,55 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdint.h>
+
+/*
+ 	Small signal processing kernels shared by the processing stages. They are
+ 	written with the gcc vector extensions, which map to NEON or SSE when the
+ 	target supports it and fall back to scalar code otherwise.
+ */
+
+float dsp_dot(const float *a, const float *b, unsigned int n);
+void dsp_axpy(float *y, float a, const float *x, unsigned int n);
+void dsp_mul(float *y, const float *x, unsigned int n);
+void dsp_power(const float *re, const float *im, float *out, unsigned int n);
+void dsp_fft(float *re, float *im, const float *cos_tab, const float *sin_tab,
+             unsigned int n, int inverse);
+
+#define DSP_MAX_CHANNELS 2
+
+/* Transposed direct form II biquad, one state per channel */
+struct dsp_biquad {
+	float b0, b1, b2, a1, a2;
+	float z1[DSP_MAX_CHANNELS];
+	float z2[DSP_MAX_CHANNELS];
+};
+
+void dsp_s16_to_float(const int16_t *in, float *out, unsigned int n);
+void dsp_float_to_s16(const float *in, int16_t *out, unsigned int n);
+void dsp_biquad(struct dsp_biquad *bq, float *buf, unsigned int frames, unsigned int channels);
+float dsp_mean_square_s16(const int16_t *buf, unsigned int n);
+void dsp_levels_s16(const int16_t *buf, unsigned int n, int *peak, float *mean_square);
+void dsp_gain_s16(const int16_t *in, int16_t *out, unsigned int n, float gain);
+float dsp_ramp_s16(int16_t *buf, unsigned int frames, unsigned int channels, float gain, float step);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "eq.h"
+
+#define EQ_MAX_STAGES	8
+// Frames converted to float and filtered in one go, small enough to stay in cache
+#define EQ_BLOCK	256
+// Limiter release, per frame
+#define EQ_RELEASE	0.0005f
+
+enum {
+	EQ_PEAKING,
+	EQ_LOWSHELF,
+	EQ_HIGHSHELF,
+	EQ_LOWPASS,
+	EQ_HIGHPASS
+};
+
+struct eq_stage {
+	int type;
+	double freq;
+	double gain;
+	double q;
+	struct dsp_biquad bq;
+};
+
+struct eq_route {
+	int route_id;
+	int stage_count;
+	struct eq_stage stages[EQ_MAX_STAGES];
+	int limiter;
+	float threshold;
+};
+
+struct eq {
+	int route_count;
+	struct eq_route *routes;
+	struct eq_route *active;
+	int active_id;
+	unsigned int channels;
+	float limiter_gain;
+	float block[EQ_BLOCK * DSP_MAX_CHANNELS];
+};
+
+static const char *eq_type_names[] = {
+	"peaking", "lowshelf", "highshelf", "lowpass", "highpass"
+};
+
+static int eq_parse_stage(struct eq_stage *stage, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	const char *id, *type;
+	unsigned int t;
+
+	stage->type=-1;
+	stage->q=0.707;
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "type") == 0) {
+			if (snd_config_get_string(n, &type) < 0)
+				goto invalid;
+			for (t = 0; t < sizeof(eq_type_names)/sizeof(eq_type_names[0]); t++)
+				if (strcmp(type, eq_type_names[t]) == 0)
+					stage->type = t;
+			if (stage->type < 0)
+				goto invalid;
+			continue;
+		}
+		if (strcmp(id, "freq") == 0) {
+			if (snd_config_get_ireal(n, &stage->freq) < 0 || stage->freq <= 0)
+				goto invalid;
+			continue;
+		}
+		if (strcmp(id, "gain") == 0) {
+			if (snd_config_get_ireal(n, &stage->gain) < 0)
+				goto invalid;
+			continue;
+		}
+		if (strcmp(id, "q") == 0) {
+			if (snd_config_get_ireal(n, &stage->q) < 0 || stage->q <= 0)
+				goto invalid;
+			continue;
+		}
+		SNDERR("Unknown eq field %s", id);
+		return -EINVAL;
+	}
+
+	if (stage->type < 0 || stage->freq <= 0) {
+		SNDERR("eq stage needs a type and a freq");
+		return -EINVAL;
+	}
+	return 0;
+
+invalid:
+	SNDERR("Invalid value for eq field %s", id);
+	return -EINVAL;
+}
+
+static int eq_parse_route(struct eq_route *route, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	const char *id;
+	double threshold;
+	int err;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "limiter") == 0) {
+			if (snd_config_get_ireal(n, &threshold) < 0 || threshold > 0) {
+				SNDERR("Invalid value for eq limiter");
+				return -EINVAL;
+			}
+			route->limiter = 1;
+			route->threshold = pow(10.0, threshold / 20.0);
+			continue;
+		}
+		if (route->stage_count >= EQ_MAX_STAGES) {
+			SNDERR("Too many eq stages, at most %d", EQ_MAX_STAGES);
+			return -EINVAL;
+		}
+		if ((err = eq_parse_stage(&route->stages[route->stage_count], n)) < 0)
+			return err;
+		route->stage_count++;
+	}
+	return 0;
+}
+
+int eq_new(struct eq **eqp, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	struct eq *eq;
+	const char *id;
+	char *end;
+	int err;
+
+	eq = calloc(1, sizeof(*eq));
+	if (!eq)
+		return -ENOMEM;
+
+	snd_config_for_each(i, next, conf)
+		eq->route_count++;
+	eq->routes = calloc(eq->route_count, sizeof(eq->routes[0]));
+	if (eq->route_count && !eq->routes) {
+		free(eq);
+		return -ENOMEM;
+	}
+
+	eq->route_count = 0;
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		struct eq_route *route = &eq->routes[eq->route_count];
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		route->route_id = strtol(id, &end, 0);
+		if (*end) {
+			SNDERR("eq entries must be route ids, got %s", id);
+			err = -EINVAL;
+			goto error;
+		}
+		if ((err = eq_parse_route(route, n)) < 0)
+			goto error;
+		eq->route_count++;
+	}
+
+	eq->active_id = -1;
+	eq->limiter_gain = 1.0f;
+	*eqp = eq;
+	return 0;
+
+error:
+	eq_free(eq);
+	return err;
+}
+
+void eq_free(struct eq *eq)
+{
+	if (!eq)
+		return;
+	free(eq->routes);
+	free(eq);
+}
+
+// Biquad coefficients from the Audio EQ Cookbook by Robert Bristow-Johnson
+static void eq_stage_setup(struct eq_stage *stage, unsigned int rate)
+{
+	double w0 = 2 * M_PI * stage->freq / rate;
+	double cw = cos(w0), alpha = sin(w0) / (2 * stage->q);
+	double A = pow(10.0, stage->gain / 40.0), sa = 2 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (stage->type) {
+		case EQ_PEAKING:
+			b0 = 1 + alpha * A; b1 = -2 * cw; b2 = 1 - alpha * A;
+			a0 = 1 + alpha / A; a1 = -2 * cw; a2 = 1 - alpha / A;
+			break;
+		case EQ_LOWSHELF:
+			b0 = A * ((A + 1) - (A - 1) * cw + sa);
+			b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+			b2 = A * ((A + 1) - (A - 1) * cw - sa);
+			a0 = (A + 1) + (A - 1) * cw + sa;
+			a1 = -2 * ((A - 1) + (A + 1) * cw);
+			a2 = (A + 1) + (A - 1) * cw - sa;
+			break;
+		case EQ_HIGHSHELF:
+			b0 = A * ((A + 1) + (A - 1) * cw + sa);
+			b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+			b2 = A * ((A + 1) + (A - 1) * cw - sa);
+			a0 = (A + 1) - (A - 1) * cw + sa;
+			a1 = 2 * ((A - 1) - (A + 1) * cw);
+			a2 = (A + 1) - (A - 1) * cw - sa;
+			break;
+		case EQ_LOWPASS:
+			b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+			break;
+		default:
+			b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+	}
+
+	memset(&stage->bq, 0, sizeof(stage->bq));
+	stage->bq.b0 = b0 / a0;
+	stage->bq.b1 = b1 / a0;
+	stage->bq.b2 = b2 / a0;
+	stage->bq.a1 = a1 / a0;
+	stage->bq.a2 = a2 / a0;
+}
+
+void eq_setup(struct eq *eq, unsigned int rate, unsigned int channels)
+{
+	int r, s;
+
+	eq->channels = channels;
+	for (r = 0; r < eq->route_count; r++)
+		for (s = 0; s < eq->routes[r].stage_count; s++)
+			eq_stage_setup(&eq->routes[r].stages[s], rate);
+
+	// Forces the filter state to be cleared on the next selection
+	eq->active_id = -1;
+	eq->active = NULL;
+}
+
+void eq_select_route(struct eq *eq, int route_id)
+{
+	int r, s;
+
+	if (route_id == eq->active_id)
+		return;
+
+	eq->active_id = route_id;
+	eq->active = NULL;
+	eq->limiter_gain = 1.0f;
+	for (r = 0; r < eq->route_count; r++) {
+		if (eq->routes[r].route_id != route_id)
+			continue;
+		eq->active = &eq->routes[r];
+		for (s = 0; s < eq->active->stage_count; s++) {
+			memset(eq->active->stages[s].bq.z1, 0, sizeof(eq->active->stages[s].bq.z1));
+			memset(eq->active->stages[s].bq.z2, 0, sizeof(eq->active->stages[s].bq.z2));
+		}
+		break;
+	}
+}
+
+int eq_active(struct eq *eq)
+{
+	return eq && eq->active;
+}
+
+static void eq_limit(struct eq *eq, float *buf, unsigned int frames)
+{
+	float threshold = eq->active->threshold;
+	float gain = eq->limiter_gain, peak, v;
+	unsigned int i, c;
+
+	for (i = 0; i < frames; i++) {
+		peak = 0;
+		for (c = 0; c < eq->channels; c++) {
+			v = fabsf(buf[i * eq->channels + c]);
+			if (v > peak)
+				peak = v;
+		}
+
+		// Instant attack, slow release
+		if (peak * gain > threshold)
+			gain = threshold / peak;
+		else if (gain < 1.0f)
+			gain = gain + EQ_RELEASE > 1.0f ? 1.0f : gain + EQ_RELEASE;
+
+		for (c = 0; c < eq->channels; c++)
+			buf[i * eq->channels + c] *= gain;
+	}
+	eq->limiter_gain = gain;
+}
+
+void eq_process(struct eq *eq, const int16_t *in, int16_t *out, unsigned int frames)
+{
+	unsigned int block, samples;
+	int s;
+
+	while (frames) {
+		block = frames < EQ_BLOCK ? frames : EQ_BLOCK;
+		samples = block * eq->channels;
+
+		dsp_s16_to_float(in, eq->block, samples);
+		for (s = 0; s < eq->active->stage_count; s++)
+			dsp_biquad(&eq->active->stages[s].bq, eq->block, block, eq->channels);
+		if (eq->active->limiter)
+			eq_limit(eq, eq->block, block);
+		dsp_float_to_s16(eq->block, out, samples);
+
+		in += samples;
+		out += samples;
+		frames -= block;
+	}
+}
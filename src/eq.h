@@ -0,0 +1,44 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <alsa/asoundlib.h>
+
+#include "dsp.h"
+
+/*
+ 	Per route equalizer for the playback path: a cascade of biquads followed
+ 	by an optional peak limiter, selected by the active route id. Configured
+ 	from asoundrc:
+
+ 	eq {
+ 		1 {
+ 			0 { type highpass freq 200 q 0.7 }
+ 			1 { type peaking freq 3000 gain -4 q 1.0 }
+ 			limiter -1.0
+ 		}
+ 	}
+ */
+struct eq;
+
+int eq_new(struct eq **eqp, snd_config_t *conf);
+void eq_free(struct eq *eq);
+void eq_setup(struct eq *eq, unsigned int rate, unsigned int channels);
+void eq_select_route(struct eq *eq, int route_id);
+int eq_active(struct eq *eq);
+void eq_process(struct eq *eq, const int16_t *in, int16_t *out, unsigned int frames);
@@ -0,0 +1,216 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "hotplug.h"
+
+#define HOTPLUG_MSG_SIZE	2048
+
+struct hotplug {
+	char *switch_path;
+	const char *switch_name;
+	int event_fd;
+	int stop_pipe[2];
+	int state;
+	hotplug_callback_t callback;
+	void *arg;
+	pthread_t thread;
+};
+
+static int hotplug_read_state(struct hotplug *hp)
+{
+	char path[512], value[16];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/state", hp->switch_path);
+	fd=open(path, O_RDONLY);
+	if(fd<0)
+		return -1;
+	len=read(fd, value, sizeof(value) - 1);
+	close(fd);
+	if(len<=0)
+		return -1;
+	value[len]=0;
+
+	return atoi(value);
+}
+
+// Returns non zero if the uevent is about our switch
+static int hotplug_match(struct hotplug *hp, const char *msg, int len)
+{
+	const char *p, *end=msg + len;
+	int subsystem=0, name=0;
+
+	for(p=msg; p<end; p+=strlen(p) + 1){
+		if(!strcmp(p, "SUBSYSTEM=switch"))
+			subsystem=1;
+		else if(!strncmp(p, "SWITCH_NAME=", 12) && !strcmp(p + 12, hp->switch_name))
+			name=1;
+	}
+	return subsystem && name;
+}
+
+static void hotplug_update(struct hotplug *hp)
+{
+	int state=hotplug_read_state(hp);
+
+	if(state<0 || state==hp->state)
+		return;
+	hp->state=state;
+	hp->callback(hp->arg, state);
+}
+
+// Waits for uevents. It is running in a seperate thread
+static void *hotplug_thread(void *arg)
+{
+	struct hotplug *hp=arg;
+	struct pollfd pfd[2];
+	char msg[HOTPLUG_MSG_SIZE];
+	int len;
+
+	// Applies the state found at startup, if it changed meanwhile
+	hotplug_update(hp);
+
+	pfd[0].fd=hp->event_fd;
+	pfd[0].events=POLLIN;
+	pfd[1].fd=hp->stop_pipe[0];
+	pfd[1].events=POLLIN;
+
+	while(1){
+		if(poll(pfd, 2, -1)<0){
+			if(errno==EINTR)
+				continue;
+			break;
+		}
+		if(pfd[1].revents)
+			break;
+		if(!(pfd[0].revents & POLLIN))
+			continue;
+
+		len=read(hp->event_fd, msg, sizeof(msg) - 1);
+		if(len<=0)
+			continue;
+		msg[len]=0;
+
+		if(hotplug_match(hp, msg, len))
+			hotplug_update(hp);
+	}
+
+	return NULL;
+}
+
+static int hotplug_open_netlink(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd=socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if(fd<0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family=AF_NETLINK;
+	addr.nl_pid=0;
+	addr.nl_groups=1;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int hotplug_start(struct hotplug **hpp, const char *switch_path, const char *uevent_path,
+                  int state, hotplug_callback_t callback, void *arg)
+{
+	struct hotplug *hp;
+	const char *slash;
+	int err;
+
+	hp=calloc(1, sizeof(*hp));
+	if(!hp)
+		return -ENOMEM;
+
+	hp->switch_path=strdup(switch_path);
+	slash=strrchr(hp->switch_path, '/');
+	hp->switch_name=slash ? slash + 1 : hp->switch_path;
+	hp->state=state;
+	hp->callback=callback;
+	hp->arg=arg;
+	hp->stop_pipe[0]=hp->stop_pipe[1]=-1;
+
+	// A FIFO is opened read/write so it never reports end of file
+	if(uevent_path)
+		hp->event_fd=open(uevent_path, O_RDWR | O_NONBLOCK);
+	else
+		hp->event_fd=hotplug_open_netlink();
+	if(hp->event_fd<0){
+		err=-errno;
+		goto error;
+	}
+
+	if(pipe(hp->stop_pipe)){
+		err=-errno;
+		goto error;
+	}
+
+	err=-pthread_create(&hp->thread, NULL, hotplug_thread, hp);
+	if(err)
+		goto error;
+
+	*hpp=hp;
+	return 0;
+
+error:
+	if(hp->event_fd>=0)
+		close(hp->event_fd);
+	if(hp->stop_pipe[0]>=0){
+		close(hp->stop_pipe[0]);
+		close(hp->stop_pipe[1]);
+	}
+	free(hp->switch_path);
+	free(hp);
+	return err;
+}
+
+void hotplug_stop(struct hotplug *hp)
+{
+	char c=0;
+
+	if(!hp)
+		return;
+
+	write(hp->stop_pipe[1], &c, 1);
+	pthread_join(hp->thread, NULL);
+
+	close(hp->event_fd);
+	close(hp->stop_pipe[0]);
+	close(hp->stop_pipe[1]);
+	free(hp->switch_path);
+	free(hp);
+}
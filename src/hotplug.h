@@ -0,0 +1,40 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+/*
+ 	Headset switch watcher. Follows the state file of a switch class device
+ 	(/sys/class/switch/h2w by default) and rereads it whenever a kernel
+ 	uevent for that switch arrives. The uevents come from the netlink
+ 	socket, or from a FIFO carrying uevent formatted messages when one is
+ 	given, which allows driving the watcher from a fake sysfs tree.
+ 	The callback only runs for a state other than the last one seen,
+ 	starting from the state passed to hotplug_start (-1 for unknown).
+ */
+struct hotplug;
+
+typedef void (*hotplug_callback_t)(void *arg, int state);
+
+int hotplug_start(struct hotplug **hpp, const char *switch_path, const char *uevent_path,
+                  int state, hotplug_callback_t callback, void *arg);
+void hotplug_stop(struct hotplug *hp);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "monitor.h"
+
+// Frames kept in the ring, must be a power of 2
+#define MONITOR_FRAMES	16384
+
+/*
+ 	Bumped with every change to struct monitor_ring. The segment key
+ 	follows it, so builds with another layout use another segment instead
+ 	of misreading this one.
+ */
+#define MONITOR_VERSION	2
+#define MONITOR_KEY_ID	('M' + MONITOR_VERSION)
+// Also catches builds disagreeing on the size of long
+#define MONITOR_LAYOUT	((MONITOR_VERSION << 24) | sizeof(struct monitor_ring))
+// Readers recheck the ring at least this often
+#define MONITOR_WAIT_NS	100000000
+
+struct monitor_ring {
+	unsigned int layout;		// MONITOR_LAYOUT once attached
+	int readers;			// reader slots taken, the writer copies nothing at 0
+	int reader_pid[MONITOR_READERS];	// 0 for a free slot
+	int writer;			// pid holding the write lock, 0 when free
+	unsigned long reap_pos;		// write position of the last dead reader check
+	int seq;			// bumped after each write, readers wait on it
+	int sleepers;			// readers blocked on seq
+	unsigned int rate;
+	unsigned long write_pos;	// frames written since creation
+	int16_t data[MONITOR_FRAMES * 2];	// always stereo
+};
+
+struct monitor_ring *monitor_attach(void)
+{
+	struct monitor_ring *ring;
+	key_t key;
+	int fd, shm_id;
+
+	fd=open("/tmp/alsa_android", O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	close(fd);
+
+	key=ftok("/tmp/alsa_android", MONITOR_KEY_ID);
+	if(key==-1)
+		return NULL;
+
+	shm_id=shmget(key, sizeof(*ring), IPC_CREAT | 0666);
+	if(shm_id==-1)
+		return NULL;
+
+	ring=shmat(shm_id, NULL, 0);
+	if(ring==(void *)-1)
+		return NULL;
+
+	// A zeroed ring is a valid empty one, the first process stamps it
+	if(!__sync_bool_compare_and_swap(&ring->layout, 0, MONITOR_LAYOUT) &&
+	   ring->layout!=MONITOR_LAYOUT){
+		shmdt(ring);
+		errno=EPROTO;
+		return NULL;
+	}
+
+	return ring;
+}
+
+void monitor_detach(struct monitor_ring *ring)
+{
+	if(ring)
+		shmdt(ring);
+}
+
+static int monitor_alive(int pid)
+{
+	return kill(pid, 0)==0 || errno!=ESRCH;
+}
+
+/*
+ 	Takes a reader slot for the calling process, or the slot of a reader
+ 	that died. Returns the slot or -EBUSY.
+ */
+int monitor_add_reader(struct monitor_ring *ring)
+{
+	int i, pid;
+
+	for(i=0; i<MONITOR_READERS; i++){
+		pid=ring->reader_pid[i];
+		if(pid && monitor_alive(pid))
+			continue;
+		if(!__sync_bool_compare_and_swap(&ring->reader_pid[i], pid, getpid()))
+			continue;
+		// A dead reader was still counted
+		if(!pid)
+			__sync_fetch_and_add(&ring->readers, 1);
+		return i;
+	}
+	return -EBUSY;
+}
+
+void monitor_remove_reader(struct monitor_ring *ring, int slot)
+{
+	if(slot>=0 && __sync_bool_compare_and_swap(&ring->reader_pid[slot], getpid(), 0))
+		__sync_fetch_and_sub(&ring->readers, 1);
+}
+
+// Frees the slots of readers that died without closing
+static void monitor_reap(struct monitor_ring *ring)
+{
+	int i, pid;
+
+	for(i=0; i<MONITOR_READERS; i++){
+		pid=ring->reader_pid[i];
+		if(pid && !monitor_alive(pid) &&
+		   __sync_bool_compare_and_swap(&ring->reader_pid[i], pid, 0))
+			__sync_fetch_and_sub(&ring->readers, 1);
+	}
+}
+
+/*
+ 	Serializes playback streams writing at the same time. A writer that
+ 	died holding the lock is replaced.
+ */
+static void monitor_lock(struct monitor_ring *ring)
+{
+	int pid=getpid(), owner;
+
+	while(!__sync_bool_compare_and_swap(&ring->writer, 0, pid)){
+		owner=ring->writer;
+		if(owner && !monitor_alive(owner))
+			__sync_bool_compare_and_swap(&ring->writer, owner, 0);
+		else
+			sched_yield();
+	}
+}
+
+static void monitor_unlock(struct monitor_ring *ring)
+{
+	__sync_synchronize();
+	ring->writer=0;
+}
+
+void monitor_write(struct monitor_ring *ring, const int16_t *buf, unsigned int frames,
+                   unsigned int channels, unsigned int rate)
+{
+	unsigned long pos;
+	unsigned int i, slot;
+
+	if(!ring || !ring->readers)
+		return;
+
+	monitor_lock(ring);
+	pos=ring->write_pos;
+	for(i=0; i<frames; i++){
+		slot=((pos + i) & (MONITOR_FRAMES - 1)) * 2;
+		ring->data[slot]=buf[i * channels];
+		ring->data[slot + 1]=buf[i * channels + channels - 1];
+	}
+	ring->rate=rate;
+
+	__sync_synchronize();
+	ring->write_pos=pos + frames;
+
+	// About once a second, so a crashed reader does not keep the copy going
+	if(ring->write_pos - ring->reap_pos>=rate){
+		ring->reap_pos=ring->write_pos;
+		monitor_reap(ring);
+	}
+	monitor_unlock(ring);
+
+	__sync_fetch_and_add(&ring->seq, 1);
+	// The wake is a system call, only paid when a reader actually sleeps
+	if(ring->sleepers)
+		syscall(SYS_futex, &ring->seq, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+unsigned long monitor_position(struct monitor_ring *ring)
+{
+	return ring->write_pos;
+}
+
+unsigned int monitor_rate(struct monitor_ring *ring)
+{
+	return ring->rate;
+}
+
+int monitor_read(struct monitor_ring *ring, unsigned long *pos, int16_t *buf,
+                 unsigned int frames, unsigned int channels, int nonblock)
+{
+	struct timespec timeout={0, MONITOR_WAIT_NS};
+	unsigned long avail;
+	unsigned int i, slot;
+	int seq;
+
+	while(1){
+		seq=ring->seq;
+		__sync_synchronize();
+		avail=ring->write_pos - *pos;
+
+		// The reader fell behind by a full ring, jumps back to live
+		if(avail>MONITOR_FRAMES){
+			*pos=ring->write_pos - MONITOR_FRAMES / 2;
+			continue;
+		}
+		if(avail)
+			break;
+		if(nonblock)
+			return -EAGAIN;
+		__sync_fetch_and_add(&ring->sleepers, 1);
+		syscall(SYS_futex, &ring->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+		__sync_fetch_and_sub(&ring->sleepers, 1);
+	}
+
+	if(frames>avail)
+		frames=avail;
+
+	for(i=0; i<frames; i++){
+		slot=((*pos + i) & (MONITOR_FRAMES - 1)) * 2;
+		if(channels==2){
+			buf[i * 2]=ring->data[slot];
+			buf[i * 2 + 1]=ring->data[slot + 1];
+		}else{
+			buf[i]=(ring->data[slot] + ring->data[slot + 1]) / 2;
+		}
+	}
+	*pos+=frames;
+
+	return frames;
+}
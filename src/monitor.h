@@ -0,0 +1,47 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+
+/*
+ 	Playback monitor: the playback path copies the frames it sends to the
+ 	device into a shared memory ring, but only while at least one monitor
+ 	capture PCM is open. Up to MONITOR_READERS readers follow the ring with
+ 	their own position, so they never slow down the writer. Concurrent
+ 	playback streams take turns on the ring.
+ */
+#define MONITOR_READERS	16
+
+struct monitor_ring;
+
+struct monitor_ring *monitor_attach(void);
+void monitor_detach(struct monitor_ring *ring);
+int monitor_add_reader(struct monitor_ring *ring);
+void monitor_remove_reader(struct monitor_ring *ring, int slot);
+void monitor_write(struct monitor_ring *ring, const int16_t *buf, unsigned int frames,
+                   unsigned int channels, unsigned int rate);
+unsigned long monitor_position(struct monitor_ring *ring);
+unsigned int monitor_rate(struct monitor_ring *ring);
+int monitor_read(struct monitor_ring *ring, unsigned long *pos, int16_t *buf,
+                 unsigned int frames, unsigned int channels, int nonblock);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+
+#include "preproc.h"
+
+// Frames converted to float and processed in one go
+#define PREPROC_BLOCK	256
+// Corner of the DC blocking high-pass
+#define PREPROC_DC_HZ	60
+// Blocks quieter than -60dBFS leave the gain alone, so pauses are not pumped up
+#define PREPROC_AGC_FLOOR	0.001f
+// Time constants of the gain going down and up, in seconds
+#define PREPROC_AGC_ATTACK	0.01f
+#define PREPROC_AGC_RELEASE	0.5f
+#define PREPROC_AGC_MIN_GAIN	0.1f
+// Spectral power smoothing between frames
+#define PREPROC_NS_SMOOTH	0.7f
+// Growth of the noise floor estimate per frame while above the minimum
+#define PREPROC_NS_RISE	1.005f
+// Over subtraction, the minimum sits well below the mean noise power
+#define PREPROC_NS_OVER	4.0f
+
+struct preproc {
+	int dc;
+	int agc;
+	float agc_target;	// rms, full scale is 1.0
+	float agc_max_gain;
+	int ns;
+	float ns_floor;		// smallest gain of a bin
+
+	unsigned int rate;
+	unsigned int channels;
+	struct dsp_biquad dc_bq;
+	float agc_gain;
+	float block[PREPROC_BLOCK * DSP_MAX_CHANNELS];
+
+	/*
+	 	Noise suppression, weighted overlap add with half overlapping sqrt
+	 	Hann windows. in keeps the last n input samples, olap the output
+	 	ready to be read followed by the tail of the last frame.
+	 */
+	unsigned int n;
+	unsigned int pos;	// samples taken in the current hop
+	unsigned int frames_seen;
+	float *mem;
+	float *window, *cos_tab, *sin_tab;
+	float *in[DSP_MAX_CHANNELS], *olap[DSP_MAX_CHANNELS];
+	float *re[DSP_MAX_CHANNELS], *im[DSP_MAX_CHANNELS];
+	float *power, *smooth, *noise, *gain;
+};
+
+int preproc_new(struct preproc **ppp, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	struct preproc *pp;
+	const char *id;
+	double v;
+	int err;
+
+	pp = calloc(1, sizeof(*pp));
+	if (!pp)
+		return -ENOMEM;
+	pp->agc_max_gain = pow(10.0, 24 / 20.0);
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "dc") == 0) {
+			if ((err = snd_config_get_bool(n)) < 0)
+				goto invalid;
+			pp->dc = err;
+			continue;
+		}
+		if (strcmp(id, "agc") == 0) {
+			if (snd_config_get_ireal(n, &v) < 0 || v > 0)
+				goto invalid;
+			pp->agc = 1;
+			pp->agc_target = pow(10.0, v / 20.0);
+			continue;
+		}
+		if (strcmp(id, "agc_max_gain") == 0) {
+			if (snd_config_get_ireal(n, &v) < 0 || v < 0)
+				goto invalid;
+			pp->agc_max_gain = pow(10.0, v / 20.0);
+			continue;
+		}
+		if (strcmp(id, "ns") == 0) {
+			if (snd_config_get_ireal(n, &v) < 0 || v <= 0)
+				goto invalid;
+			pp->ns = 1;
+			pp->ns_floor = pow(10.0, -v / 20.0);
+			continue;
+		}
+		SNDERR("Unknown preproc field %s", id);
+		preproc_free(pp);
+		return -EINVAL;
+	}
+
+	*ppp = pp;
+	return 0;
+
+invalid:
+	SNDERR("Invalid value for preproc field %s", id);
+	preproc_free(pp);
+	return -EINVAL;
+}
+
+void preproc_free(struct preproc *pp)
+{
+	if (!pp)
+		return;
+	free(pp->mem);
+	free(pp);
+}
+
+int preproc_setup(struct preproc *pp, unsigned int rate, unsigned int channels)
+{
+	double w0, cw, alpha, a0;
+	unsigned int c, k, n, bins;
+	float *p;
+
+	if (channels > DSP_MAX_CHANNELS)
+		return -EINVAL;
+	pp->rate = rate;
+	pp->channels = channels;
+
+	// Audio EQ Cookbook high-pass, q 0.707
+	w0 = 2 * M_PI * PREPROC_DC_HZ / rate;
+	cw = cos(w0);
+	alpha = sin(w0) / (2 * 0.707);
+	a0 = 1 + alpha;
+	memset(&pp->dc_bq, 0, sizeof(pp->dc_bq));
+	pp->dc_bq.b0 = (1 + cw) / 2 / a0;
+	pp->dc_bq.b1 = -(1 + cw) / a0;
+	pp->dc_bq.b2 = (1 + cw) / 2 / a0;
+	pp->dc_bq.a1 = -2 * cw / a0;
+	pp->dc_bq.a2 = (1 - alpha) / a0;
+
+	if (!pp->ns) {
+		preproc_reset(pp);
+		return 0;
+	}
+
+	// Frames of about 16 to 32ms
+	n = rate <= 16000 ? 256 : 512;
+	bins = n / 2 + 1;
+	free(pp->mem);
+	pp->mem = calloc(n * 2 + (n * 4) * channels + n * 2 + bins * 2, sizeof(float));
+	if (!pp->mem)
+		return -ENOMEM;
+
+	p = pp->mem;
+	pp->window = p; p += n;
+	pp->cos_tab = p; p += n / 2;
+	pp->sin_tab = p; p += n / 2;
+	for (c = 0; c < channels; c++) {
+		pp->in[c] = p; p += n;
+		pp->olap[c] = p; p += n;
+		pp->re[c] = p; p += n;
+		pp->im[c] = p; p += n;
+	}
+	pp->power = p; p += n;
+	pp->gain = p; p += n;
+	pp->smooth = p; p += bins;
+	pp->noise = p;
+
+	for (k = 0; k < n; k++)
+		pp->window[k] = sqrt(0.5 - 0.5 * cos(2 * M_PI * k / n));
+	for (k = 0; k < n / 2; k++) {
+		pp->cos_tab[k] = cos(2 * M_PI * k / n);
+		pp->sin_tab[k] = sin(2 * M_PI * k / n);
+	}
+	pp->n = n;
+	preproc_reset(pp);
+	return 0;
+}
+
+void preproc_reset(struct preproc *pp)
+{
+	unsigned int c;
+
+	memset(pp->dc_bq.z1, 0, sizeof(pp->dc_bq.z1));
+	memset(pp->dc_bq.z2, 0, sizeof(pp->dc_bq.z2));
+	pp->agc_gain = 1.0f;
+
+	if (!pp->ns || !pp->mem)
+		return;
+	// The noise estimate restarts from the first frame
+	pp->pos = 0;
+	pp->frames_seen = 0;
+	for (c = 0; c < pp->channels; c++) {
+		memset(pp->in[c], 0, pp->n * sizeof(float));
+		memset(pp->olap[c], 0, pp->n * sizeof(float));
+	}
+}
+
+/*
+ 	Processes the last n input samples: the gains of the bins come from the
+ 	power spectrum averaged over the channels against a minimum tracking
+ 	noise estimate.
+ */
+static void preproc_ns_frame(struct preproc *pp)
+{
+	unsigned int n = pp->n, hop = n / 2, bins = n / 2 + 1;
+	unsigned int c, k;
+	float g;
+
+	memset(pp->power, 0, bins * sizeof(float));
+	for (c = 0; c < pp->channels; c++) {
+		memcpy(pp->re[c], pp->in[c], n * sizeof(float));
+		dsp_mul(pp->re[c], pp->window, n);
+		memset(pp->im[c], 0, n * sizeof(float));
+		dsp_fft(pp->re[c], pp->im[c], pp->cos_tab, pp->sin_tab, n, 0);
+		dsp_power(pp->re[c], pp->im[c], pp->gain, bins);
+		dsp_axpy(pp->power, 1.0f / pp->channels, pp->gain, bins);
+	}
+
+	for (k = 0; k < bins; k++) {
+		if (!pp->frames_seen) {
+			pp->smooth[k] = pp->power[k];
+			pp->noise[k] = pp->power[k];
+		}
+		pp->smooth[k] = PREPROC_NS_SMOOTH * pp->smooth[k] + (1 - PREPROC_NS_SMOOTH) * pp->power[k];
+		if (pp->smooth[k] < pp->noise[k])
+			pp->noise[k] = pp->smooth[k];
+		else
+			pp->noise[k] *= PREPROC_NS_RISE;
+
+		g = 1.0f - PREPROC_NS_OVER * pp->noise[k] / (pp->smooth[k] + 1e-12f);
+		if (g < pp->ns_floor)
+			g = pp->ns_floor;
+		pp->gain[k] = g;
+		// The spectrum of a real signal is symmetric
+		if (k && k < n / 2)
+			pp->gain[n - k] = g;
+	}
+
+	for (c = 0; c < pp->channels; c++) {
+		dsp_mul(pp->re[c], pp->gain, n);
+		dsp_mul(pp->im[c], pp->gain, n);
+		dsp_fft(pp->re[c], pp->im[c], pp->cos_tab, pp->sin_tab, n, 1);
+		dsp_mul(pp->re[c], pp->window, n);
+		for (k = 0; k < hop; k++) {
+			pp->olap[c][k] = pp->olap[c][hop + k] + pp->re[c][k] / n;
+			pp->olap[c][hop + k] = pp->re[c][hop + k] / n;
+		}
+		memmove(pp->in[c], pp->in[c] + hop, hop * sizeof(float));
+	}
+	pp->frames_seen++;
+}
+
+// Streams the interleaved samples through the frames, delaying them by one frame
+static void preproc_ns(struct preproc *pp, float *buf, unsigned int frames)
+{
+	unsigned int hop = pp->n / 2, ch = pp->channels;
+	unsigned int i, c;
+
+	for (i = 0; i < frames; i++) {
+		for (c = 0; c < ch; c++) {
+			pp->in[c][hop + pp->pos] = buf[i * ch + c];
+			buf[i * ch + c] = pp->olap[c][pp->pos];
+		}
+		if (++pp->pos == hop) {
+			preproc_ns_frame(pp);
+			pp->pos = 0;
+		}
+	}
+}
+
+// Moves the gain towards the target level, ramping it over the block
+static void preproc_agc(struct preproc *pp, float *buf, unsigned int frames)
+{
+	unsigned int samples = frames * pp->channels, i, c;
+	float rms, desired, target = pp->agc_gain, tau, step, g;
+
+	rms = sqrtf(dsp_dot(buf, buf, samples) / samples);
+	if (rms > PREPROC_AGC_FLOOR) {
+		desired = pp->agc_target / rms;
+		if (desired > pp->agc_max_gain)
+			desired = pp->agc_max_gain;
+		else if (desired < PREPROC_AGC_MIN_GAIN)
+			desired = PREPROC_AGC_MIN_GAIN;
+		tau = desired < target ? PREPROC_AGC_ATTACK : PREPROC_AGC_RELEASE;
+		target += (desired - target) * (1.0f - expf(-(float)frames / (pp->rate * tau)));
+	}
+
+	step = (target - pp->agc_gain) / frames;
+	for (i = 0; i < frames; i++) {
+		g = pp->agc_gain + step * (i + 1);
+		for (c = 0; c < pp->channels; c++)
+			buf[i * pp->channels + c] *= g;
+	}
+	pp->agc_gain = target;
+}
+
+void preproc_process(struct preproc *pp, int16_t *buf, unsigned int frames)
+{
+	unsigned int block, samples;
+
+	while (frames) {
+		block = frames < PREPROC_BLOCK ? frames : PREPROC_BLOCK;
+		samples = block * pp->channels;
+
+		dsp_s16_to_float(buf, pp->block, samples);
+		if (pp->dc)
+			dsp_biquad(&pp->dc_bq, pp->block, block, pp->channels);
+		if (pp->ns)
+			preproc_ns(pp, pp->block, block);
+		if (pp->agc)
+			preproc_agc(pp, pp->block, block);
+		dsp_float_to_s16(pp->block, buf, samples);
+
+		buf += samples;
+		frames -= block;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PREPROC_H
+#define PREPROC_H
+
+#include <alsa/asoundlib.h>
+
+#include "dsp.h"
+
+/*
+ 	Capture preprocessing, applied once in the plugin for every reader of
+ 	the PCM: a DC blocking high-pass, spectral noise suppression and an
+ 	automatic gain control, in that order. Noise suppression delays the
+ 	capture by one frame of 256 (up to 16KHz) or 512 samples. Each stage is
+ 	enabled by its field in asoundrc:
+
+ 	preproc {
+ 		dc yes
+ 		ns 12		# maximum noise attenuation in dB
+ 		agc -20		# target level in dBFS
+ 		agc_max_gain 24	# dB
+ 	}
+ */
+struct preproc;
+
+int preproc_new(struct preproc **ppp, snd_config_t *conf);
+void preproc_free(struct preproc *pp);
+int preproc_setup(struct preproc *pp, unsigned int rate, unsigned int channels);
+// Forgets the signal seen so far, for a stream prepared again
+void preproc_reset(struct preproc *pp);
+void preproc_process(struct preproc *pp, int16_t *buf, unsigned int frames);
+
+#endif
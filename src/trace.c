@@ -0,0 +1,134 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#ifndef TRACE_COMPONENT
+#define TRACE_COMPONENT "alsa_android"
+#endif
+
+// Number of events kept, must be a power of 2
+#define TRACE_SIZE	16384
+
+struct trace_event {
+	unsigned long seq;	// index + 1 once the slot is complete, 0 while written
+	const char *name;
+	char phase;
+	int tid;
+	long long start;
+	long long end;
+	long arg;
+};
+
+int trace_enabled;
+
+static struct trace_event *trace_ring;
+static unsigned long trace_head;
+static const char *trace_prefix;
+static __thread int trace_tid;
+
+long long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record(const char *name, char phase, long long start, long long end, long arg)
+{
+	struct trace_event *ev;
+	unsigned long index;
+
+	if(!trace_tid)
+		trace_tid=syscall(SYS_gettid);
+
+	// Writers only contend on the head, each one owns its slot afterwards
+	index=__sync_fetch_and_add(&trace_head, 1);
+	ev=&trace_ring[index & (TRACE_SIZE - 1)];
+
+	ev->seq=0;
+	__sync_synchronize();
+	ev->name=name;
+	ev->phase=phase;
+	ev->tid=trace_tid;
+	ev->start=start;
+	ev->end=end;
+	ev->arg=arg;
+	__sync_synchronize();
+	ev->seq=index + 1;
+}
+
+// Runs when the plugin is unloaded or the process exits
+static void __attribute__ ((destructor)) trace_dump(void)
+{
+	unsigned long head, first, i;
+	struct trace_event *ev;
+	char path[256];
+	FILE *f;
+	int sep=0;
+
+	if(!trace_enabled)
+		return;
+	trace_enabled=0;
+	head=trace_head;
+	first=head>TRACE_SIZE ? head - TRACE_SIZE : 0;
+
+	snprintf(path, sizeof(path), "%s.%d.%s.json", trace_prefix, (int)getpid(), TRACE_COMPONENT);
+	f=fopen(path, "w");
+	if(!f)
+		return;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for(i=first; i<head; i++){
+		ev=&trace_ring[i & (TRACE_SIZE - 1)];
+		if(ev->seq!=i + 1)
+			continue;
+		fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+		        sep ? ",\n" : "", ev->name, TRACE_COMPONENT, ev->phase, (int)getpid(), ev->tid,
+		        ev->start / 1000.0);
+		if(ev->phase=='X')
+			fprintf(f, ",\"dur\":%.3f", (ev->end - ev->start) / 1000.0);
+		else
+			fprintf(f, ",\"s\":\"t\"");
+		fprintf(f, ",\"args\":{\"value\":%ld}}", ev->arg);
+		sep=1;
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+static void __attribute__ ((constructor)) trace_init(void)
+{
+	trace_prefix=getenv("ALSA_ANDROID_TRACE");
+	if(!trace_prefix || !*trace_prefix)
+		return;
+
+	trace_ring=calloc(TRACE_SIZE, sizeof(*trace_ring));
+	if(!trace_ring)
+		return;
+
+	trace_enabled=1;
+}
@@ -0,0 +1,42 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Per process event trace. Enabled by setting ALSA_ANDROID_TRACE to a file
+ 	prefix; the events are kept in a lock free ring and written at exit as
+ 	Chrome trace JSON to <prefix>.<pid>.<component>.json, which loads in
+ 	chrome://tracing and Perfetto. When disabled every trace point costs a
+ 	single test of trace_enabled.
+ */
+
+extern int trace_enabled;
+
+long long trace_now(void);
+void trace_record(const char *name, char phase, long long start, long long end, long arg);
+
+// Declares the start time of a duration event
+#define TRACE_BEGIN(var)	long long var = trace_enabled ? trace_now() : 0
+
+// Records a duration event started with TRACE_BEGIN
+#define TRACE_END(var, name, arg) \
+	do { if (trace_enabled) trace_record(name, 'X', var, trace_now(), arg); } while (0)
+
+// Records an instant event
+#define TRACE_MARK(name, arg) \
+	do { if (trace_enabled) { long long _now = trace_now(); trace_record(name, 'i', _now, _now, arg); } } while (0)
@@ -26,6 +26,11 @@
 #include <sys/ioctl.h>
 #include <alsa/asoundlib.h>
 #include <sys/shm.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #ifndef uint32_t
 #define uint32_t unsigned int
@@ -33,51 +38,295 @@
 #include <linux/msm_audio.h>
 
 #include "utils.h"
+#include "trace.h"
+
+/*
+ 	Bumped with every change to struct shared_props_s. The segment key
+ 	follows it, so a segment left by a build with another layout is not
+ 	attached: its size would fail shmget and its fields would be misread.
+ */
+#define SHARED_VERSION	4
+#define SHARED_KEY_ID	('D' + SHARED_VERSION)
+// Also catches builds disagreeing on the size of long
+#define SHARED_LAYOUT	((SHARED_VERSION << 24) | sizeof(struct shared_props_s))
+// Setting the defaults takes microseconds, an initializer this late is gone
+#define SHARED_INIT_TIMEOUT_NS	500000000LL
+
+// A PCM instance registered for its own volume and mute
+struct shared_stream_s{
+	int pid;	// 0 while the slot is free
+	int stream;
+	char name[SHARED_STREAM_NAME_MAX];
+	long volume;	// percent
+	long mute;
+};
+
+// Period size tuned on a stream direction, route, rate and channel count
+struct shared_tune_s{
+	int seq;	// odd while the entry is being written
+	int stream;
+	int route_id;
+	unsigned int rate;
+	unsigned int channels;
+	long period_frames;	// 0 while the entry is unused
+};
 
 struct shared_props_s{
-	int is_initialized;
+	unsigned int layout;	// SHARED_LAYOUT once attached
+	int is_initialized;	// 2 while the first process sets the defaults
+	int init_pid;		// process setting the defaults
+	int changes;		// bumped by every control change, watchers wait on it
+	int change_sleepers;
+	int call_seq;		// odd while the call state below is being written
 	long volume;
 	unsigned int route;
 	int route_id;
+	long ear_mute;
+	long mic_mute;
 	long rec_flag;
+	long duplex_latency;
+	long peak[2];	// indexed by stream direction
+	long rms[2];
+	struct shared_stream_s streams[SHARED_STREAM_SLOTS];
+	struct shared_tune_s tune[SHARED_TUNE_SLOTS];
+	int hotplug_owner;	// pid of the process running the headset watcher
+	int hotplug_state;	// last headset state applied, -1 before the first
+	int hotplug_restore;	// route to restore on unplug, -1 for none
 };
 
 static int shared_props_initialized=0;
+static pthread_mutex_t shared_props_lock=PTHREAD_MUTEX_INITIALIZER;
 struct shared_props_s *shared_props;
 
-static int shared_props_init(void)
+static void shared_props_defaults(void)
 {
-	if(shared_props_initialized)
-		return 0;
+	shared_props->volume=3;
+	shared_props->route=1;
+	shared_props->route_id=1;
+	shared_props->ear_mute=1;
+	shared_props->mic_mute=1;
+	shared_props->rec_flag=1;
+	shared_props->hotplug_state=-1;
+	shared_props->hotplug_restore=-1;
+	__sync_synchronize();
+	shared_props->is_initialized=1;
+}
+
+static long long shared_props_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int shared_props_attach(void)
+{
+	long long deadline;
+	int pid;
 
 	int fd=open("/tmp/alsa_android", O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	close(fd);
 
-	key_t key=ftok("/tmp/alsa_android", 'D');
+	key_t key=ftok("/tmp/alsa_android", SHARED_KEY_ID);
 	if(key==-1){
 		SNDERR("Shared key generation failed");
 		return errno;
 	}
 
 	int shm_id=shmget(key, sizeof(*shared_props), IPC_CREAT  | 0666);
+	if(shm_id==-1){
+		SNDERR("Shared memory creation failed: %s", strerror(errno));
+		return errno;
+	}
 	shared_props=shmat(shm_id, NULL, 0);
 	if(shared_props==(void *)-1){
 		SNDERR("Shared memory access failed with id=%d", shm_id);
 		return errno;
 	}
 
+	// A zeroed segment is a valid uninitialized one, the first process stamps it
+	if(!__sync_bool_compare_and_swap(&shared_props->layout, 0, SHARED_LAYOUT) &&
+	   shared_props->layout!=SHARED_LAYOUT){
+		SNDERR("Shared memory layout %#x does not match %#x", shared_props->layout, (unsigned int)SHARED_LAYOUT);
+		shmdt(shared_props);
+		shared_props=NULL;
+		return EPROTO;
+	}
+
+	// Only one process sets the defaults, the others wait for them
+	if(__sync_bool_compare_and_swap(&shared_props->is_initialized, 0, 2)){
+		shared_props->init_pid=getpid();
+		shared_props_defaults();
+	}
+
+	/*
+	 	An initializer that died, or did not even record its pid before
+	 	the deadline, is replaced by the first waiter taking its pid.
+	 */
+	deadline=shared_props_now_ns() + SHARED_INIT_TIMEOUT_NS;
+	while(shared_props->is_initialized==2){
+		pid=shared_props->init_pid;
+		if((pid && kill(pid, 0) && errno==ESRCH) || shared_props_now_ns()>deadline){
+			if(__sync_bool_compare_and_swap(&shared_props->init_pid, pid, getpid()))
+				shared_props_defaults();
+			deadline=shared_props_now_ns() + SHARED_INIT_TIMEOUT_NS;
+			continue;
+		}
+		sched_yield();
+	}
+
+	__sync_synchronize();
 	shared_props_initialized=1;
+	return 0;
+}
+
+// Threads of a process, like the feeder and the ctl monitor, attach once
+static int shared_props_init(void)
+{
+	int ret=0;
+
+	if(shared_props_initialized)
+		return 0;
+
+	pthread_mutex_lock(&shared_props_lock);
+	if(!shared_props_initialized)
+		ret=shared_props_attach();
+	pthread_mutex_unlock(&shared_props_lock);
+	return ret;
+}
+
+// Wakes the watchers after a control change, the wake only when one sleeps
+static void shared_props_changed(void)
+{
+	__sync_fetch_and_add(&shared_props->changes, 1);
+	if(shared_props->change_sleepers)
+		syscall(SYS_futex, &shared_props->changes, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+// Change count to pass to shared_props_wait_change, read before the values
+int shared_props_changes(void)
+{
+	if(shared_props_init())
+		return 0;
+	return shared_props->changes;
+}
+
+/*
+ 	Sleeps until a control change after the count was taken, or for at
+ 	most timeout_us. A negative timeout waits for the change only.
+ */
+void shared_props_wait_change(int changes, long timeout_us)
+{
+	struct timespec timeout={timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+
+	if(shared_props_init()){
+		if(timeout_us<0)
+			pause();
+		else
+			usleep(timeout_us);
+		return;
+	}
+
+	__sync_fetch_and_add(&shared_props->change_sleepers, 1);
+	syscall(SYS_futex, &shared_props->changes, FUTEX_WAIT, changes, timeout_us<0 ? NULL : &timeout, NULL, 0);
+	__sync_fetch_and_sub(&shared_props->change_sleepers, 1);
+}
+
+/*
+ 	The call state is a seqlock: writers of any process take it by making
+ 	call_seq odd, readers retry until they saw the same even count around
+ 	their copy.
+ */
+static void shared_props_call_lock(void)
+{
+	int seq;
 
-	if(!shared_props->is_initialized){
-		// Set the default values
-		shared_props->volume=3;
-		shared_props->route=1;
-		shared_props->route_id=1;
-		shared_props->is_initialized=1;
+	while(1){
+		seq=shared_props->call_seq;
+		if(!(seq & 1) && __sync_bool_compare_and_swap(&shared_props->call_seq, seq, seq + 1))
+			break;
+		sched_yield();
 	}
+}
+
+static void shared_props_call_unlock(void)
+{
+	__sync_fetch_and_add(&shared_props->call_seq, 1);
+	shared_props_changed();
+}
+
+// Consistent copy of the call state, seq identifies the version read
+int shared_props_get_call(struct shared_call_state *state, int *seq)
+{
+	int ret=shared_props_init();
+	int start;
+	if(ret)
+		return ret;
+
+	while(1){
+		start=shared_props->call_seq;
+		if(start & 1){
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		state->route=shared_props->route;
+		state->route_id=shared_props->route_id;
+		state->ear_mute=shared_props->ear_mute;
+		state->mic_mute=shared_props->mic_mute;
+		state->volume=shared_props->volume;
+		__sync_synchronize();
+		if(shared_props->call_seq==start)
+			break;
+	}
+	if(seq)
+		*seq=start;
 	return 0;
 }
 
+/*
+ 	Publishes the SHARED_CALL_* fields of state as a single change, and
+ 	fills state with the whole call state as published. Returns the mask of
+ 	what differs from the previous state, for the caller to send only the
+ 	RPCs needed, or a negative error.
+ */
+int shared_props_set_call(struct shared_call_state *state, int fields, int *seq)
+{
+	int changed=0;
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	shared_props_call_lock();
+	if((fields & SHARED_CALL_ROUTE) &&
+	   (shared_props->route!=state->route || shared_props->route_id!=state->route_id)){
+		shared_props->route=state->route;
+		shared_props->route_id=state->route_id;
+		changed|=SHARED_CALL_ROUTE;
+	}
+	if((fields & SHARED_CALL_MUTE) &&
+	   (shared_props->ear_mute!=state->ear_mute || shared_props->mic_mute!=state->mic_mute)){
+		shared_props->ear_mute=state->ear_mute;
+		shared_props->mic_mute=state->mic_mute;
+		changed|=SHARED_CALL_MUTE;
+	}
+	if((fields & SHARED_CALL_VOLUME) && shared_props->volume!=state->volume){
+		shared_props->volume=state->volume;
+		changed|=SHARED_CALL_VOLUME;
+	}
+	state->route=shared_props->route;
+	state->route_id=shared_props->route_id;
+	state->ear_mute=shared_props->ear_mute;
+	state->mic_mute=shared_props->mic_mute;
+	state->volume=shared_props->volume;
+	if(seq)
+		*seq=shared_props->call_seq + 1;
+	shared_props_call_unlock();
+
+	return changed;
+}
+
 int shared_props_get_volume(long *value)
 {
 	int ret=shared_props_init();
@@ -118,13 +367,36 @@ int shared_props_get_route_id(int *value)
 	return 0;
 }
 
+int shared_props_get_duplex_latency(long *value)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	*value=shared_props->duplex_latency;
+	return 0;
+}
+
+int shared_props_get_levels(int stream, long *peak, long *rms)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	*peak=shared_props->peak[stream];
+	*rms=shared_props->rms[stream];
+	return 0;
+}
+
 int shared_props_set_volume(long value)
 {
 	int ret=shared_props_init();
 	if(ret)
 		return ret;
 
+	shared_props_call_lock();
 	shared_props->volume=value;
+	shared_props_call_unlock();
 	return 0;
 }
 
@@ -135,6 +407,7 @@ int shared_props_set_rec_flag(long value)
 		return ret;
 
 	shared_props->rec_flag=value;
+	shared_props_changed();
 	return 0;
 }
 
@@ -144,7 +417,9 @@ int shared_props_set_route(unsigned int value)
 	if(ret)
 		return ret;
 
+	shared_props_call_lock();
 	shared_props->route=value;
+	shared_props_call_unlock();
 	return 0;
 }
 
@@ -154,14 +429,295 @@ int shared_props_set_route_id(int value)
 	if(ret)
 		return ret;
 
+	shared_props_call_lock();
 	shared_props->route_id=value;
+	shared_props_call_unlock();
+	return 0;
+}
+
+int shared_props_set_duplex_latency(long value)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	shared_props->duplex_latency=value;
+	return 0;
+}
+
+int shared_props_set_levels(int stream, long peak, long rms)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	// Sound after silence wakes the watchers, which stop sampling silent meters
+	if(!shared_props->peak[stream] && !shared_props->rms[stream] && (peak || rms)){
+		shared_props->peak[stream]=peak;
+		shared_props->rms[stream]=rms;
+		shared_props_changed();
+		return 0;
+	}
+
+	shared_props->peak[stream]=peak;
+	shared_props->rms[stream]=rms;
+	return 0;
+}
+
+// Returns -ENOENT while the entry is unused
+int shared_props_get_tuned_period(int slot, int *stream, int *route_id, unsigned int *rate,
+                                  unsigned int *channels, long *frames)
+{
+	struct shared_tune_s *t;
+	int seq, ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	// Retried until no writer changed the entry around the copy
+	t=&shared_props->tune[slot];
+	while(1){
+		seq=t->seq;
+		if(seq & 1){
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		*frames=t->period_frames;
+		*stream=t->stream;
+		*route_id=t->route_id;
+		*rate=t->rate;
+		*channels=t->channels;
+		__sync_synchronize();
+		if(t->seq==seq)
+			break;
+	}
+	if(!*frames)
+		return -ENOENT;
+	return 0;
+}
+
+/*
+ 	Replaces the entry with the same key, else takes a free one, else
+ 	overwrites the entry the key hashes to.
+ */
+int shared_props_set_tuned_period(int stream, int route_id, unsigned int rate,
+                                  unsigned int channels, long frames)
+{
+	struct shared_tune_s *t=NULL;
+	int i, seq, ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	for(i=0; i<SHARED_TUNE_SLOTS && !t; i++){
+		struct shared_tune_s *e=&shared_props->tune[i];
+		if(e->period_frames && e->stream==stream && e->route_id==route_id &&
+		   e->rate==rate && e->channels==channels)
+			t=e;
+	}
+	for(i=0; i<SHARED_TUNE_SLOTS && !t; i++){
+		if(!shared_props->tune[i].period_frames)
+			t=&shared_props->tune[i];
+	}
+	if(!t)
+		t=&shared_props->tune[((unsigned int)(route_id * 2 + stream) * 31 + rate + channels) % SHARED_TUNE_SLOTS];
+
+	// Written under an odd count, as the call state, readers never see half an entry
+	while(1){
+		seq=t->seq;
+		if(!(seq & 1) && __sync_bool_compare_and_swap(&t->seq, seq, seq + 1))
+			break;
+		sched_yield();
+	}
+	t->stream=stream;
+	t->route_id=route_id;
+	t->rate=rate;
+	t->channels=channels;
+	t->period_frames=frames;
+	__sync_fetch_and_add(&t->seq, 1);
 	return 0;
 }
 
+/*
+ 	One headset watcher runs per system, in the process holding the owner
+ 	pid. A dead owner is replaced on the next claim. Returns 1 when the
+ 	caller became the owner.
+ */
+int shared_hotplug_claim(void)
+{
+	int owner;
+
+	if(shared_props_init())
+		return 0;
+
+	owner=shared_props->hotplug_owner;
+	if(owner && (owner==getpid() || kill(owner, 0)==0 || errno!=ESRCH))
+		return 0;
+	return __sync_bool_compare_and_swap(&shared_props->hotplug_owner, owner, getpid());
+}
+
+void shared_hotplug_release(void)
+{
+	if(shared_props_init())
+		return;
+	__sync_bool_compare_and_swap(&shared_props->hotplug_owner, getpid(), 0);
+}
+
+int shared_hotplug_get(int *state, int *restore)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	if(state)
+		*state=shared_props->hotplug_state;
+	if(restore)
+		*restore=shared_props->hotplug_restore;
+	return 0;
+}
+
+int shared_hotplug_set(int state, int restore)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	shared_props->hotplug_state=state;
+	shared_props->hotplug_restore=restore;
+	return 0;
+}
+
+/*
+ 	Claims a free slot of the stream registry for the calling process.
+ 	Slots left by processes that died without closing or while claiming
+ 	are taken over.
+ 	Returns the slot or a negative error.
+ */
+int shared_stream_register(int stream, const char *name)
+{
+	struct shared_stream_s *s;
+	int ret=shared_props_init();
+	int i, pid;
+
+	if(ret)
+		return -ret;
+
+	for(i=0; i<SHARED_STREAM_SLOTS; i++){
+		s=&shared_props->streams[i];
+		pid=s->pid;
+		/*
+		 	A slot being claimed holds the negated pid of the claimer, a
+		 	claimer that died before finishing leaves it free.
+		 */
+		if(pid && (kill(pid<0 ? -pid : pid, 0)==0 || errno!=ESRCH))
+			continue;
+		if(!__sync_bool_compare_and_swap(&s->pid, pid, -getpid()))
+			continue;
+
+		s->stream=stream;
+		strncpy(s->name, name, SHARED_STREAM_NAME_MAX - 1);
+		s->name[SHARED_STREAM_NAME_MAX - 1]=0;
+		s->volume=100;
+		s->mute=0;
+		__sync_synchronize();
+		s->pid=getpid();
+		shared_props_changed();
+		return i;
+	}
+	return -EBUSY;
+}
+
+void shared_stream_unregister(int slot)
+{
+	if(slot<0 || shared_props_init())
+		return;
+	shared_props->streams[slot].pid=0;
+	shared_props_changed();
+}
+
+// Returns 0 and the description of the slot if it is registered
+int shared_stream_get(int slot, int *pid, int *stream, char *name, size_t len)
+{
+	struct shared_stream_s *s;
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	s=&shared_props->streams[slot];
+	if(s->pid<=0)
+		return -ENOENT;
+	*pid=s->pid;
+	*stream=s->stream;
+	strncpy(name, s->name, len - 1);
+	name[len - 1]=0;
+	return 0;
+}
+
+int shared_stream_get_gain(int slot, long *volume, long *mute)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	*volume=shared_props->streams[slot].volume;
+	*mute=shared_props->streams[slot].mute;
+	return 0;
+}
+
+int shared_stream_set_volume(int slot, long value)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	// Percents, the gain of the stream never goes above unity
+	if(value<0)
+		value=0;
+	else if(value>100)
+		value=100;
+	shared_props->streams[slot].volume=value;
+	shared_props_changed();
+	return 0;
+}
+
+int shared_stream_set_mute(int slot, long value)
+{
+	int ret=shared_props_init();
+	if(ret)
+		return ret;
+
+	shared_props->streams[slot].mute=value;
+	shared_props_changed();
+	return 0;
+}
+
+/*
+ 	The control device is opened once per process and kept open, so the
+ 	route and volume RPCs cost a single ioctl each.
+ */
+static int snd_control_fd=-1;
+
+int snd_control_open(void)
+{
+	int fd=snd_control_fd;
+	if(fd>-1)
+		return fd;
+
+	fd=open("/dev/msm_snd", O_RDWR | O_CLOEXEC);
+	if(fd<0)
+		return -1;
+
+	// Another thread may have raced us to it, keep a single descriptor
+	if(!__sync_bool_compare_and_swap(&snd_control_fd, -1, fd)){
+		close(fd);
+		fd=snd_control_fd;
+	}
+	return fd;
+}
+
 int set_volume_rpc(int volume)
 {
 	int i;
-	int fd = open("/dev/msm_snd", O_RDWR);
+	int fd = snd_control_open();
 	if (fd < 0) {
 		return errno;
 	}
@@ -178,13 +734,14 @@ int set_volume_rpc(int volume)
 	*/
 	for(i=0;i<=3;i++){
 		args.device = i;
-		if (ioctl(fd, SND_SET_VOLUME, &args) < 0) {
+		TRACE_BEGIN(t);
+		int ret = ioctl(fd, SND_SET_VOLUME, &args);
+		TRACE_END(t, "SND_SET_VOLUME", volume);
+		if (ret < 0) {
 			printf("set_volume_rpc failed\n");
-			close(fd);
 			return errno;
 		}
 	}
-	close(fd);
 
 	return 0;
 }
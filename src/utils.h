@@ -18,13 +18,60 @@
  */
 
 
+/* Tuned period sizes, by stream direction, route, rate and channels */
+#define SHARED_TUNE_SLOTS	16
+
+/* Stream registry, a slot per open PCM with its own volume and mute */
+#define SHARED_STREAM_SLOTS	16
+#define SHARED_STREAM_NAME_MAX	32
+
+/* Route, call mutes and volume, published together as one change */
+struct shared_call_state{
+	unsigned int route;	// endpoint index
+	int route_id;		// endpoint id
+	long ear_mute;
+	long mic_mute;
+	long volume;
+};
+
+/* Parts of the call state, to set and as changed by shared_props_set_call */
+#define SHARED_CALL_ROUTE	1
+#define SHARED_CALL_MUTE	2
+#define SHARED_CALL_VOLUME	4
+
+int shared_props_changes(void);
+void shared_props_wait_change(int changes, long timeout_us);
+
 int shared_props_get_volume(long *value);
 int shared_props_get_rec_flag(long *value);
 int shared_props_get_route(unsigned int *value);
 int shared_props_get_route_id(int *value);
+int shared_props_get_duplex_latency(long *value);
+int shared_props_get_levels(int stream, long *peak, long *rms);
 int shared_props_set_volume(long value);
 int shared_props_set_rec_flag(long value);
 int shared_props_set_route(unsigned int value);
 int shared_props_set_route_id(int value);
+int shared_props_set_duplex_latency(long value);
+int shared_props_set_levels(int stream, long peak, long rms);
+int shared_props_get_call(struct shared_call_state *state, int *seq);
+int shared_props_set_call(struct shared_call_state *state, int fields, int *seq);
+int shared_props_get_tuned_period(int slot, int *stream, int *route_id, unsigned int *rate,
+                                  unsigned int *channels, long *frames);
+int shared_props_set_tuned_period(int stream, int route_id, unsigned int rate,
+                                  unsigned int channels, long frames);
+
+int shared_hotplug_claim(void);
+void shared_hotplug_release(void);
+int shared_hotplug_get(int *state, int *restore);
+int shared_hotplug_set(int state, int restore);
+
+int shared_stream_register(int stream, const char *name);
+void shared_stream_unregister(int slot);
+int shared_stream_get(int slot, int *pid, int *stream, char *name, size_t len);
+int shared_stream_get_gain(int slot, long *volume, long *mute);
+int shared_stream_set_volume(int slot, long value);
+int shared_stream_set_mute(int slot, long value);
 
+int snd_control_open(void);
 int set_volume_rpc(int volume);
@@ -0,0 +1,226 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Counts the calls the plugin makes per period on its hot path, against
+ 	the stand-in nodes of the shim, and fails when one exceeds its budget.
+
+ 	budget [-r] [-p periods] <case> [<kind>=<max per period>] ...
+
+ 	The cases are playback, capture and tsched. The kinds are those of
+ 	shim_kind_names; kinds without a budget are only reported. -r paces
+ 	the stand-in nodes at the stream rate.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "harness.h"
+#include "shim.h"
+
+#define WARMUP_PERIODS	8
+
+struct budget_case{
+	const char *name;
+	snd_pcm_stream_t stream;
+	const char *options;
+	unsigned int rate;
+	unsigned int channels;
+	snd_pcm_uframes_t period;	// frames
+	unsigned int periods;		// per buffer
+};
+
+static const struct budget_case cases[] = {
+	{ "playback", SND_PCM_STREAM_PLAYBACK, "", 44100, 2, 1200, 2 },
+	{ "capture", SND_PCM_STREAM_CAPTURE, "", 8000, 1, 1024, 2 },
+	{ "tsched", SND_PCM_STREAM_PLAYBACK, "tsched yes", 44100, 2, 1200, 4 },
+};
+
+static int budget_set_params(snd_pcm_t *pcm, const struct budget_case *c)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_uframes_t period=c->period;
+	int ret;
+
+	ret=snd_pcm_hw_params_malloc(&params);
+	if(ret<0)
+		return ret;
+	if((ret=snd_pcm_hw_params_any(pcm, params))<0 ||
+	   (ret=snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED))<0 ||
+	   (ret=snd_pcm_hw_params_set_format(pcm, params, SND_PCM_FORMAT_S16_LE))<0 ||
+	   (ret=snd_pcm_hw_params_set_channels(pcm, params, c->channels))<0 ||
+	   (ret=snd_pcm_hw_params_set_rate(pcm, params, c->rate, 0))<0 ||
+	   (ret=snd_pcm_hw_params_set_period_size_near(pcm, params, &period, NULL))<0 ||
+	   (ret=snd_pcm_hw_params_set_periods(pcm, params, c->periods, 0))<0)
+		goto out;
+	ret=snd_pcm_hw_params(pcm, params);
+	if(ret==0 && period!=c->period)
+		fprintf(stderr, "%s: period of %lu frames instead of %lu\n", c->name, period, c->period);
+out:
+	snd_pcm_hw_params_free(params);
+	return ret;
+}
+
+static int budget_transfer(snd_pcm_t *pcm, const struct budget_case *c, int16_t *buf)
+{
+	snd_pcm_sframes_t ret;
+	snd_pcm_uframes_t done=0;
+
+	while(done<c->period){
+		if(c->stream==SND_PCM_STREAM_PLAYBACK)
+			ret=snd_pcm_writei(pcm, buf + done * c->channels, c->period - done);
+		else
+			ret=snd_pcm_readi(pcm, buf + done * c->channels, c->period - done);
+		if(ret<0)
+			ret=snd_pcm_recover(pcm, ret, 0);
+		if(ret<0)
+			return ret;
+		done+=ret;
+	}
+	return 0;
+}
+
+static int budget_parse(const char *arg, double budgets[SHIM_KINDS])
+{
+	const char *eq=strchr(arg, '=');
+	int kind;
+
+	if(!eq)
+		return -1;
+	for(kind=0; kind<SHIM_KINDS; kind++){
+		if(strlen(shim_kind_names[kind])==(size_t)(eq - arg) &&
+		   !strncmp(arg, shim_kind_names[kind], eq - arg)){
+			budgets[kind]=atof(eq + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: budget [-r] [-p periods] <playback|capture|tsched> [<kind>=<max>] ...\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const struct budget_case *c=NULL;
+	double budgets[SHIM_KINDS];
+	struct shim_counts counts;
+	snd_config_t *conf;
+	snd_pcm_t *pcm;
+	int16_t *buf;
+	char *definition;
+	unsigned int periods=200, i;
+	int opt, kind, ret, failed=0;
+
+	while((opt=getopt(argc, argv, "rp:"))!=-1){
+		switch(opt){
+			case 'r':
+				shim_set_realtime(1);
+				break;
+			case 'p':
+				periods=atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if(optind>=argc || !periods)
+		usage();
+	for(i=0; i<sizeof(cases) / sizeof(cases[0]); i++)
+		if(!strcmp(argv[optind], cases[i].name))
+			c=&cases[i];
+	if(!c)
+		usage();
+	for(kind=0; kind<SHIM_KINDS; kind++)
+		budgets[kind]=-1;
+	for(optind++; optind<argc; optind++){
+		if(budget_parse(argv[optind], budgets)){
+			fprintf(stderr, "unknown budget %s\n", argv[optind]);
+			usage();
+		}
+	}
+
+	if(asprintf(&definition, "pcm.budget { type alsa_android %s }", c->options)<0)
+		return 1;
+	ret=harness_config(definition, &conf);
+	free(definition);
+	if(ret<0){
+		fprintf(stderr, "config: %s\n", snd_strerror(ret));
+		return 1;
+	}
+
+	ret=snd_pcm_open_lconf(&pcm, "budget", c->stream, 0, conf);
+	if(ret<0){
+		fprintf(stderr, "%s: open: %s\n", c->name, snd_strerror(ret));
+		return 1;
+	}
+	ret=budget_set_params(pcm, c);
+	if(ret<0){
+		fprintf(stderr, "%s: hw params: %s\n", c->name, snd_strerror(ret));
+		return 1;
+	}
+
+	buf=malloc(c->period * c->channels * sizeof(*buf));
+	if(!buf)
+		return 1;
+	harness_fill(buf, c->period, c->channels, c->rate);
+
+	// Opens the device and starts it, that is not the hot path
+	for(i=0; i<WARMUP_PERIODS; i++){
+		ret=budget_transfer(pcm, c, buf);
+		if(ret<0)
+			break;
+	}
+
+	shim_reset();
+	for(i=0; i<periods && ret==0; i++)
+		ret=budget_transfer(pcm, c, buf);
+	shim_get_counts(&counts);
+	if(ret<0){
+		fprintf(stderr, "%s: transfer: %s\n", c->name, snd_strerror(ret));
+		return 1;
+	}
+
+	printf("%s: %u periods of %lu frames\n", c->name, periods, c->period);
+	for(kind=0; kind<SHIM_KINDS; kind++){
+		double per_period=(double)counts.plugin[kind] / periods;
+
+		printf("  %-8s %8.2f per period (%lu, %lu with alsa-lib)", shim_kind_names[kind],
+		       per_period, counts.plugin[kind], counts.total[kind]);
+		if(budgets[kind]>=0){
+			printf(" budget %.2f%s", budgets[kind], per_period>budgets[kind] ? " EXCEEDED" : "");
+			if(per_period>budgets[kind])
+				failed=1;
+		}
+		printf("\n");
+	}
+
+	if(c->stream==SND_PCM_STREAM_PLAYBACK)
+		snd_pcm_drain(pcm);
+	snd_pcm_close(pcm);
+	snd_config_delete(conf);
+	free(buf);
+	return failed;
+}
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Hot path budgets of the PCM plugin, in calls per period. Extra budget
+# flags, like -p 1000, can be passed in BUDGET_FLAGS.
+
+set -e
+
+./budget $BUDGET_FLAGS playback syscalls=2 writes=1 ioctls=0 opens=0 mallocs=0
+./budget $BUDGET_FLAGS capture syscalls=2 reads=1 ioctls=0 opens=0 mallocs=0
+./budget $BUDGET_FLAGS -r -p 100 tsched syscalls=4 writes=1 reads=1 ioctls=0 opens=0 mallocs=0
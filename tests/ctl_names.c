@@ -0,0 +1,123 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Reads every fixed control element and writes the writable ones by
+ 	name, with no numid, as amixer cset name=... does, and checks the
+ 	writes reach the stand-in /dev/msm_snd of the shim.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+#include "shim.h"
+
+static const char *names[] = {
+	"PCM Playback Volume",
+	"Playback Route",
+	"Record Capture Switch",
+	"Duplex Round Trip Latency",
+	"Playback Peak Meter",
+	"Playback RMS Meter",
+	"Capture Peak Meter",
+	"Capture RMS Meter",
+	"Call Playback Switch",
+	"Call Capture Switch",
+	"Call Setup",
+};
+
+static void ctl_name(snd_ctl_elem_value_t *value, const char *name)
+{
+	snd_ctl_elem_value_clear(value);
+	snd_ctl_elem_value_set_interface(value, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_value_set_name(value, name);
+}
+
+int main(void)
+{
+	snd_config_t *conf;
+	snd_ctl_t *ctl;
+	snd_ctl_elem_value_t *value;
+	struct shim_devices devices;
+	unsigned int i;
+	int ret, failed=0;
+
+	ret=harness_config("ctl.names { type alsa_android }", &conf);
+	if(ret<0 || (ret=snd_ctl_open_lconf(&ctl, "names", 0, conf))<0 ||
+	   (ret=snd_ctl_elem_value_malloc(&value))<0){
+		fprintf(stderr, "ctl open: %s\n", snd_strerror(ret));
+		return 1;
+	}
+
+	for(i=0; i<sizeof(names) / sizeof(names[0]); i++){
+		ctl_name(value, names[i]);
+		ret=snd_ctl_elem_read(ctl, value);
+		if(ret<0){
+			fprintf(stderr, "read %s: %s\n", names[i], snd_strerror(ret));
+			failed=1;
+		}
+	}
+
+	// The shim lists HANDSET, SPEAKER, HEADSET and BT with ids 0 to 3
+	ctl_name(value, "Playback Route");
+	snd_ctl_elem_value_set_enumerated(value, 0, 2);
+	ret=snd_ctl_elem_write(ctl, value);
+	shim_get_devices(&devices);
+	if(ret<0 || devices.route!=2){
+		fprintf(stderr, "write Playback Route: %s, device %d\n", snd_strerror(ret), devices.route);
+		failed=1;
+	}
+
+	ctl_name(value, "PCM Playback Volume");
+	snd_ctl_elem_value_set_integer(value, 0, 4);
+	ret=snd_ctl_elem_write(ctl, value);
+	if(ret>=0){
+		ctl_name(value, "PCM Playback Volume");
+		ret=snd_ctl_elem_read(ctl, value);
+	}
+	if(ret<0 || snd_ctl_elem_value_get_integer(value, 0)!=4){
+		fprintf(stderr, "write PCM Playback Volume: %s\n", snd_strerror(ret));
+		failed=1;
+	}
+
+	ctl_name(value, "Call Setup");
+	snd_ctl_elem_value_set_integer(value, 0, 1);
+	snd_ctl_elem_value_set_integer(value, 1, 1);
+	snd_ctl_elem_value_set_integer(value, 2, 0);
+	snd_ctl_elem_value_set_integer(value, 3, 9);
+	if(snd_ctl_elem_write(ctl, value)!=-EINVAL){
+		fprintf(stderr, "Call Setup accepted a volume of 9\n");
+		failed=1;
+	}
+	snd_ctl_elem_value_set_integer(value, 3, 3);
+	ret=snd_ctl_elem_write(ctl, value);
+	shim_get_devices(&devices);
+	if(ret<0 || devices.route!=1 || devices.ear_mute || !devices.mic_mute){
+		fprintf(stderr, "write Call Setup: %s, device %d\n", snd_strerror(ret), devices.route);
+		failed=1;
+	}
+
+	if(!failed)
+		printf("%u elements read and written by name\n", (unsigned int)(sizeof(names) / sizeof(names[0])));
+	snd_ctl_elem_value_free(value);
+	snd_ctl_close(ctl);
+	snd_config_delete(conf);
+	return failed;
+}
@@ -0,0 +1,195 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Captures from an amrnb encoder node of the shim that serves canned
+ 	frames, and checks the U8 stream delivers those frames whole, in order
+ 	and at one frame per 20ms. Without the encoder node the same PCM must
+ 	fall back to raw S16_LE capture of /dev/msm_pcm_in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "shim.h"
+
+#define FRAME_BYTES	32	// amrnb at 12.2 kbit/s
+#define FRAME_MS	20
+#define CANNED_FRAMES	50
+#define PERIOD_FRAMES	5	// codec frames in a period of the PCM
+#define READS		30
+#define LATE_MS		250
+
+static unsigned char canned[CANNED_FRAMES * FRAME_BYTES];
+
+// A mode 7 header, the frame number, then bytes that differ per frame
+static void encoder_can_frames(void)
+{
+	unsigned int i, j;
+
+	for(i=0; i<CANNED_FRAMES; i++){
+		canned[i * FRAME_BYTES]=0x3c;
+		canned[i * FRAME_BYTES + 1]=i;
+		for(j=2; j<FRAME_BYTES; j++)
+			canned[i * FRAME_BYTES + j]=i * 31 + j;
+	}
+}
+
+static int encoder_hw_params(snd_pcm_t *pcm, snd_pcm_format_t format, unsigned int rate,
+                             snd_pcm_uframes_t period, snd_pcm_uframes_t buffer)
+{
+	snd_pcm_hw_params_t *params;
+	int ret;
+
+	snd_pcm_hw_params_alloca(&params);
+	if((ret=snd_pcm_hw_params_any(pcm, params))<0 ||
+	   (ret=snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED))<0 ||
+	   (ret=snd_pcm_hw_params_set_format(pcm, params, format))<0 ||
+	   (ret=snd_pcm_hw_params_set_channels(pcm, params, 1))<0 ||
+	   (ret=snd_pcm_hw_params_set_rate(pcm, params, rate, 0))<0 ||
+	   (ret=snd_pcm_hw_params_set_period_size_near(pcm, params, &period, NULL))<0 ||
+	   (ret=snd_pcm_hw_params_set_buffer_size_near(pcm, params, &buffer))<0)
+		return ret;
+	return snd_pcm_hw_params(pcm, params);
+}
+
+// Raw capture when the encoder node is missing
+static int encoder_fallback(snd_config_t *conf)
+{
+	int16_t buf[800];
+	snd_pcm_t *pcm;
+	snd_pcm_sframes_t n;
+	int i, ret;
+
+	ret=snd_pcm_open_lconf(&pcm, "fallback", SND_PCM_STREAM_CAPTURE, 0, conf);
+	if(ret<0){
+		fprintf(stderr, "fallback open: %s\n", snd_strerror(ret));
+		return -1;
+	}
+	if(encoder_hw_params(pcm, SND_PCM_FORMAT_U8, 1150, 115, 230)>=0){
+		fprintf(stderr, "fallback PCM still takes encoded bytes\n");
+		goto fail;
+	}
+	if((ret=encoder_hw_params(pcm, SND_PCM_FORMAT_S16_LE, 8000, 800, 1600))<0){
+		fprintf(stderr, "fallback hw params: %s\n", snd_strerror(ret));
+		goto fail;
+	}
+	n=snd_pcm_readi(pcm, buf, 800);
+	if(n<=0){
+		fprintf(stderr, "fallback read: %s\n", snd_strerror(n));
+		goto fail;
+	}
+	// The square wave of the stand-in /dev/msm_pcm_in
+	for(i=0; i<n; i++){
+		if(buf[i]!=8000 && buf[i]!=-8000){
+			fprintf(stderr, "fallback sample %d is %d, not raw capture\n", i, buf[i]);
+			goto fail;
+		}
+	}
+	snd_pcm_close(pcm);
+	return 0;
+fail:
+	snd_pcm_close(pcm);
+	return -1;
+}
+
+static int encoder_capture(snd_config_t *conf)
+{
+	unsigned char buf[PERIOD_FRAMES * FRAME_BYTES];
+	snd_pcm_t *pcm;
+	snd_pcm_sframes_t n;
+	unsigned int i, frame=0;
+	long long start, ms;
+	int ret;
+
+	ret=snd_pcm_open_lconf(&pcm, "enc", SND_PCM_STREAM_CAPTURE, 0, conf);
+	if(ret<0){
+		fprintf(stderr, "encoder open: %s\n", snd_strerror(ret));
+		return -1;
+	}
+	if(encoder_hw_params(pcm, SND_PCM_FORMAT_S16_LE, 8000, 800, 1600)>=0){
+		fprintf(stderr, "encoder PCM takes raw samples\n");
+		goto fail;
+	}
+	// The byte rate of the codec, periods of 100ms in a 200ms buffer
+	if((ret=encoder_hw_params(pcm, SND_PCM_FORMAT_U8, FRAME_BYTES * 1000 / FRAME_MS,
+	                          sizeof(buf), 2 * sizeof(buf)))<0){
+		fprintf(stderr, "encoder hw params: %s\n", snd_strerror(ret));
+		goto fail;
+	}
+
+	start=harness_now_ns();
+	for(i=0; i<READS; i++){
+		n=snd_pcm_readi(pcm, buf, sizeof(buf));
+		if(n!=sizeof(buf)){
+			fprintf(stderr, "encoder read %u: %s\n", i, n<0 ? snd_strerror(n) : "short");
+			goto fail;
+		}
+		frame+=PERIOD_FRAMES;
+
+		// Frame aligned, as canned
+		if(memcmp(buf, canned + (frame - PERIOD_FRAMES) % CANNED_FRAMES * FRAME_BYTES, sizeof(buf))){
+			fprintf(stderr, "read %u does not hold frames %u to %u, starts with frame %u\n",
+			        i, frame - PERIOD_FRAMES, frame - 1, buf[1]);
+			goto fail;
+		}
+
+		// The node makes a frame each 20ms, a read can not be early
+		ms=(harness_now_ns() - start) / 1000000;
+		if(ms + 1<(long long)frame * FRAME_MS || ms>(long long)frame * FRAME_MS + LATE_MS){
+			fprintf(stderr, "frame %u came after %lldms, expected %ums\n", frame, ms, frame * FRAME_MS);
+			goto fail;
+		}
+	}
+	snd_pcm_close(pcm);
+	return 0;
+fail:
+	snd_pcm_close(pcm);
+	return -1;
+}
+
+int main(void)
+{
+	snd_config_t *conf;
+	int ret, failed=0;
+
+	ret=harness_config("pcm.enc { type alsa_android encoder \"amrnb\" }\n"
+	                   "pcm.fallback { type alsa_android encoder \"evrc\" }", &conf);
+	if(ret<0){
+		fprintf(stderr, "config: %s\n", snd_strerror(ret));
+		return 1;
+	}
+	shim_set_realtime(1);
+
+	// No canned frames yet, so the shim has no encoder nodes
+	if(encoder_fallback(conf))
+		failed=1;
+
+	encoder_can_frames();
+	shim_set_encoder_frames(canned, sizeof(canned), FRAME_BYTES);
+	if(encoder_capture(conf))
+		failed=1;
+
+	snd_config_delete(conf);
+	if(!failed)
+		printf("encoded frames whole and on time, raw capture without the node\n");
+	return failed;
+}
@@ -0,0 +1,76 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "harness.h"
+
+int harness_config(const char *definitions, snd_config_t **top)
+{
+	const char *dir=getenv("PLUGIN_DIR");
+	snd_input_t *in;
+	char *text;
+	int ret;
+
+	if(!dir)
+		dir=".";
+	if(asprintf(&text,
+	            "pcm_type.alsa_android { lib \"%s/libasound_module_pcm_alsa_android.so\" }\n"
+	            "ctl_type.alsa_android { lib \"%s/libasound_module_ctl_alsa_android.so\" }\n"
+	            "%s\n", dir, dir, definitions)<0)
+		return -ENOMEM;
+
+	ret=snd_config_top(top);
+	if(ret<0){
+		free(text);
+		return ret;
+	}
+	ret=snd_input_buffer_open(&in, text, -1);
+	if(ret==0){
+		ret=snd_config_load(*top, in);
+		snd_input_close(in);
+	}
+	free(text);
+	if(ret<0){
+		snd_config_delete(*top);
+		*top=NULL;
+	}
+	return ret;
+}
+
+long long harness_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void harness_fill(int16_t *buf, snd_pcm_uframes_t frames, unsigned int channels, unsigned int rate)
+{
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	for(i=0; i<frames; i++)
+		for(c=0; c<channels; c++)
+			buf[i * channels + c]=(i * 200 / rate) & 1 ? 8000 : -8000;
+}
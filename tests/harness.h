@@ -0,0 +1,39 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ 	Loads the plugin types from the build tree ($PLUGIN_DIR, default the
+ 	current directory) and the given pcm and ctl definitions into a config
+ 	of its own, for snd_pcm_open_lconf and snd_ctl_open_lconf.
+ */
+int harness_config(const char *definitions, snd_config_t **top);
+
+// CLOCK_MONOTONIC in nanoseconds
+long long harness_now_ns(void);
+
+// A 100Hz square wave, loud enough that no gate or idle detection drops it
+void harness_fill(int16_t *buf, snd_pcm_uframes_t frames, unsigned int channels, unsigned int rate);
+
+#endif
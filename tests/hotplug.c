@@ -0,0 +1,173 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Drives the headset watcher of the control plugin from a fake switch
+ 	class device and a uevent FIFO, and checks on the stand-in /dev/msm_snd
+ 	that plugging routes to the headset endpoint and unplugging restores
+ 	the previous route. Uevents for another switch must be ignored.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "harness.h"
+#include "shim.h"
+
+// Endpoint ids of the shim: HANDSET 0, SPEAKER 1, HEADSET 2, BT 3
+#define ROUTE_SPEAKER	1
+#define ROUTE_HEADSET	2
+#define WAIT_MS		2000
+
+static char dir[]="/tmp/aa-hotplug.XXXXXX";
+static char state_path[64], switch_path[64], fifo_path[64];
+
+static int hotplug_set_state(int state)
+{
+	FILE *f=fopen(state_path, "w");
+
+	if(!f)
+		return -1;
+	fprintf(f, "%d\n", state);
+	return fclose(f);
+}
+
+static int hotplug_uevent(const char *name, int state)
+{
+	char msg[256];
+	int fd, len;
+
+	len=snprintf(msg, sizeof(msg), "change@/devices/virtual/switch/%s%cACTION=change%cSUBSYSTEM=switch%c"
+	             "SWITCH_NAME=%s%cSWITCH_STATE=%d", name, 0, 0, 0, name, 0, state) + 1;
+	fd=open(fifo_path, O_WRONLY | O_NONBLOCK);
+	if(fd<0)
+		return -1;
+	if(write(fd, msg, len)!=len)
+		len=-1;
+	close(fd);
+	return len<0 ? -1 : 0;
+}
+
+// Waits until the last SND_SET_DEVICE is for route, returns 0 if it came
+static int hotplug_wait_route(int route)
+{
+	struct shim_devices devices;
+	long long deadline=harness_now_ns() + WAIT_MS * 1000000LL;
+
+	do{
+		shim_get_devices(&devices);
+		if(devices.route==route)
+			return 0;
+		usleep(10000);
+	}while(harness_now_ns()<deadline);
+	fprintf(stderr, "route %d after %dms, expected %d\n", devices.route, WAIT_MS, route);
+	return -1;
+}
+
+static int hotplug_route(snd_ctl_t *ctl, snd_ctl_elem_value_t *value, unsigned int route)
+{
+	snd_ctl_elem_value_set_interface(value, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_value_set_name(value, "Playback Route");
+	snd_ctl_elem_value_set_enumerated(value, 0, route);
+	return snd_ctl_elem_write(ctl, value);
+}
+
+int main(void)
+{
+	snd_config_t *conf;
+	snd_ctl_t *ctl;
+	snd_ctl_elem_value_t *value;
+	struct shim_devices devices;
+	char *definition;
+	int ret, failed=1;
+
+	if(!mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(switch_path, sizeof(switch_path), "%s/h2w", dir);
+	snprintf(state_path, sizeof(state_path), "%s/state", switch_path);
+	snprintf(fifo_path, sizeof(fifo_path), "%s/uevent", dir);
+	if(mkdir(switch_path, 0755) || hotplug_set_state(0) || mkfifo(fifo_path, 0600)){
+		perror("fake sysfs tree");
+		goto out;
+	}
+
+	if(asprintf(&definition, "ctl.hotplug { type alsa_android hotplug yes hotplug_switch \"%s\" "
+	            "hotplug_uevent \"%s\" }", switch_path, fifo_path)<0)
+		goto out;
+	ret=harness_config(definition, &conf);
+	free(definition);
+	if(ret<0 || (ret=snd_ctl_open_lconf(&ctl, "hotplug", 0, conf))<0 ||
+	   (ret=snd_ctl_elem_value_malloc(&value))<0){
+		fprintf(stderr, "ctl open: %s\n", snd_strerror(ret));
+		goto out;
+	}
+
+	/*
+	 	The watcher applies the unplugged state it starts from first. A
+	 	route write only reaches the device when it changes the route,
+	 	so the speaker is selected from another route.
+	 */
+	usleep(200000);
+	ret=hotplug_route(ctl, value, ROUTE_SPEAKER + 1);
+	if(ret>=0)
+		ret=hotplug_route(ctl, value, ROUTE_SPEAKER);
+	if(ret<0 || hotplug_wait_route(ROUTE_SPEAKER)){
+		fprintf(stderr, "route write: %s\n", snd_strerror(ret));
+		goto close;
+	}
+
+	// A switch of another name changes nothing
+	if(hotplug_set_state(1) || hotplug_uevent("usb_mass_storage", 1))
+		goto close;
+	usleep(200000);
+	shim_get_devices(&devices);
+	if(devices.route!=ROUTE_SPEAKER){
+		fprintf(stderr, "routed to %d on a uevent of another switch\n", devices.route);
+		goto close;
+	}
+
+	if(hotplug_uevent("h2w", 1) || hotplug_wait_route(ROUTE_HEADSET)){
+		fprintf(stderr, "plugging did not route to the headset, is another control running the watcher?\n");
+		goto close;
+	}
+	if(hotplug_set_state(0) || hotplug_uevent("h2w", 0) || hotplug_wait_route(ROUTE_SPEAKER)){
+		fprintf(stderr, "unplugging did not restore the speaker\n");
+		goto close;
+	}
+
+	printf("headset plug and unplug followed\n");
+	failed=0;
+close:
+	snd_ctl_elem_value_free(value);
+	snd_ctl_close(ctl);
+	snd_config_delete(conf);
+out:
+	unlink(fifo_path);
+	unlink(state_path);
+	rmdir(switch_path);
+	rmdir(dir);
+	return failed;
+}
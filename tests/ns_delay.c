@@ -0,0 +1,121 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Checks the delay documented for the noise suppression, and that a reset
+ 	forgets the previous stream. Once the stream starts with digital silence
+ 	the noise estimate stays at zero, every bin passes at unity gain and the
+ 	overlap add gives back the input delayed by exactly one frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "preproc.h"
+
+#define NS_CHUNK	160	// frames per call, as the capture reads them
+#define NS_TOLERANCE	2	// rounding of the float round trip, in LSB
+
+static const unsigned int rates[] = { 8000, 16000, 32000, 44100, 48000 };
+
+static void ns_run(struct preproc *pp, const int16_t *in, int16_t *out, unsigned int frames)
+{
+	unsigned int i, n;
+
+	memcpy(out, in, frames * sizeof(*out));
+	for(i=0; i<frames; i+=n){
+		n=frames - i < NS_CHUNK ? frames - i : NS_CHUNK;
+		preproc_process(pp, out + i, n);
+	}
+}
+
+// Returns the first frame not matching the input delayed by delay, or frames
+static unsigned int ns_check(const int16_t *in, const int16_t *out, unsigned int frames, unsigned int delay)
+{
+	unsigned int i;
+
+	for(i=0; i<frames; i++){
+		int expected=i<delay ? 0 : in[i - delay];
+		if(abs(out[i] - expected)>NS_TOLERANCE)
+			return i;
+	}
+	return frames;
+}
+
+int main(void)
+{
+	snd_config_t *top, *conf;
+	struct preproc *pp;
+	unsigned int r, i, n, frames, bad;
+	int16_t *in, *out, *again;
+	int ret, failed=0;
+
+	ret=harness_config("preproc { ns 12 }", &top);
+	if(ret<0 || snd_config_search(top, "preproc", &conf)<0){
+		fprintf(stderr, "config: %s\n", snd_strerror(ret));
+		return 1;
+	}
+
+	srand(1);
+	for(r=0; r<sizeof(rates) / sizeof(rates[0]); r++){
+		// The delay documented in README and preproc.h
+		n=rates[r]<=16000 ? 256 : 512;
+		frames=n * 16;
+		in=calloc(frames, sizeof(*in));
+		out=malloc(frames * sizeof(*out));
+		again=malloc(frames * sizeof(*again));
+		if(!in || !out || !again)
+			return 1;
+		for(i=n * 2; i<frames; i++)
+			in[i]=rand() % 20001 - 10000;
+
+		if(preproc_new(&pp, conf)<0 || preproc_setup(pp, rates[r], 1)<0){
+			fprintf(stderr, "%u: setup failed\n", rates[r]);
+			return 1;
+		}
+
+		ns_run(pp, in, out, frames);
+		bad=ns_check(in, out, frames, n);
+		if(bad<frames){
+			fprintf(stderr, "%uHz: frame %u is %d, not the input delayed by %u frames\n",
+			        rates[r], bad, out[bad], n);
+			failed=1;
+		}
+
+		// Without the reset the tail and noise estimate of the first run remain
+		preproc_reset(pp);
+		ns_run(pp, in, again, frames);
+		if(memcmp(out, again, frames * sizeof(*out))){
+			fprintf(stderr, "%uHz: output after a reset differs from a new stream\n", rates[r]);
+			failed=1;
+		}
+
+		if(!failed)
+			printf("%uHz: delay of %u frames, reset ok\n", rates[r], n);
+		preproc_free(pp);
+		free(again);
+		free(out);
+		free(in);
+	}
+
+	snd_config_delete(top);
+	return failed;
+}
@@ -0,0 +1,600 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/ioctl.h>
+#include <sys/shm.h>
+#include <sys/timerfd.h>
+
+#ifndef uint32_t
+#define uint32_t unsigned int
+#endif
+#include <linux/msm_audio.h>
+
+#include "shim.h"
+
+#define SHIM_FDS	1024
+#define SHIM_RANGES	16
+
+// Sizes reported by the stand-in nodes, those of the msm7k drivers
+#define SHIM_PLAYBACK_BUFFER	4800
+#define SHIM_CAPTURE_BUFFER	2048
+#define SHIM_BUFFERS		2
+
+enum{
+	NODE_NONE,
+	NODE_PLAYBACK,
+	NODE_CAPTURE,
+	NODE_ENCODER,
+	NODE_CONTROL};
+
+struct shim_node{
+	int type;
+	struct msm_audio_config config;
+	int started;
+	struct timespec start;
+	unsigned long bytes;	// moved since the start
+	unsigned int phase;	// of the square wave fed to captures
+	size_t canned_pos;	// next byte of the canned frames of an encoder
+};
+
+static const struct msm_snd_endpoint shim_endpoints[] = {
+	{ 0, "HANDSET" },
+	{ 1, "SPEAKER" },
+	{ 2, "HEADSET" },
+	{ 3, "BT" },
+};
+
+const char *shim_kind_names[SHIM_KINDS] = {
+	"syscalls", "ioctls", "opens", "writes", "reads", "mallocs"
+};
+
+static struct shim_node shim_nodes[SHIM_FDS];
+static struct shim_counts shim_counts;
+static struct shim_devices shim_devices={ .route=-1, .ear_mute=-1, .mic_mute=-1 };
+static int shim_realtime;
+static const unsigned char *shim_canned;
+static size_t shim_canned_bytes;
+static unsigned int shim_canned_frame;
+
+// Executable code of the plugin modules, calls from there count as plugin calls
+static struct{
+	uintptr_t start, end;
+} shim_ranges[SHIM_RANGES];
+static int shim_range_count;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+#define SHIM_REAL(name) \
+	static __typeof__(name) *real_##name; \
+	if(!real_##name) \
+		real_##name=dlsym(RTLD_NEXT, #name)
+
+// Must be expanded in the wrapper itself, for the return address
+#define SHIM_COUNT(kind) \
+	shim_count(kind, (uintptr_t)__builtin_return_address(0))
+
+static void shim_count(int kind, uintptr_t caller)
+{
+	int i;
+
+	__sync_fetch_and_add(&shim_counts.total[kind], 1);
+	for(i=0; i<shim_range_count; i++){
+		if(caller>=shim_ranges[i].start && caller<shim_ranges[i].end){
+			__sync_fetch_and_add(&shim_counts.plugin[kind], 1);
+			return;
+		}
+	}
+}
+
+static int shim_find_ranges(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int i;
+
+	if(!info->dlpi_name || !strstr(info->dlpi_name, "libasound_module_"))
+		return 0;
+	for(i=0; i<info->dlpi_phnum && shim_range_count<SHIM_RANGES; i++){
+		if(info->dlpi_phdr[i].p_type!=PT_LOAD || !(info->dlpi_phdr[i].p_flags & PF_X))
+			continue;
+		shim_ranges[shim_range_count].start=info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		shim_ranges[shim_range_count].end=shim_ranges[shim_range_count].start + info->dlpi_phdr[i].p_memsz;
+		shim_range_count++;
+	}
+	return 0;
+}
+
+static void shim_update_ranges(void)
+{
+	shim_range_count=0;
+	dl_iterate_phdr(shim_find_ranges, NULL);
+}
+
+void shim_set_realtime(int realtime)
+{
+	shim_realtime=realtime;
+}
+
+void shim_set_encoder_frames(const unsigned char *frames, size_t bytes, unsigned int frame_bytes)
+{
+	shim_canned=frames;
+	shim_canned_bytes=bytes - bytes % frame_bytes;
+	shim_canned_frame=frame_bytes;
+}
+
+void shim_reset(void)
+{
+	shim_update_ranges();
+	memset(&shim_counts, 0, sizeof(shim_counts));
+}
+
+void shim_get_counts(struct shim_counts *counts)
+{
+	__sync_synchronize();
+	*counts=shim_counts;
+}
+
+void shim_get_devices(struct shim_devices *devices)
+{
+	__sync_synchronize();
+	*devices=shim_devices;
+}
+
+static struct shim_node *shim_node(int fd)
+{
+	if(fd<0 || fd>=SHIM_FDS || shim_nodes[fd].type==NODE_NONE)
+		return NULL;
+	return &shim_nodes[fd];
+}
+
+static long long shim_elapsed_ns(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000000LL + now.tv_nsec - since->tv_nsec;
+}
+
+static long long shim_bytes_per_sec(struct shim_node *node)
+{
+	// A 20ms frame of the codec at a time
+	if(node->type==NODE_ENCODER)
+		return shim_canned_frame * 50LL;
+	return (long long)node->config.sample_rate * node->config.channel_count * 2;
+}
+
+// Sleeps for the time the node takes to move the given bytes
+static void shim_pace(struct shim_node *node, long long bytes)
+{
+	SHIM_REAL(nanosleep);
+	struct timespec ts;
+	long long ns;
+
+	if(bytes<=0)
+		return;
+	ns=bytes * 1000000000LL / shim_bytes_per_sec(node);
+	ts.tv_sec=ns / 1000000000LL;
+	ts.tv_nsec=ns % 1000000000LL;
+	real_nanosleep(&ts, NULL);
+}
+
+// Bytes the DSP consumed or produced since the start
+static long long shim_node_position(struct shim_node *node)
+{
+	if(!node->started)
+		return 0;
+	if(!shim_realtime)
+		return node->bytes;
+	return shim_elapsed_ns(&node->start) * shim_bytes_per_sec(node) / 1000000000LL;
+}
+
+static int shim_open_node(const char *path, int flags)
+{
+	SHIM_REAL(open);
+	struct shim_node *node;
+	int fd, type;
+
+	if(!strcmp(path, "/dev/msm_snd"))
+		type=NODE_CONTROL;
+	else if(!strcmp(path, "/dev/msm_pcm_out"))
+		type=NODE_PLAYBACK;
+	else if(!strcmp(path, "/dev/msm_pcm_in"))
+		type=NODE_CAPTURE;
+	else if(shim_canned){
+		type=NODE_ENCODER;
+	}else{
+		errno=ENOENT;
+		return -1;
+	}
+
+	// Any descriptor does, the node calls never reach it
+	fd=real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	if(fd<0)
+		return fd;
+	if(fd>=SHIM_FDS){
+		close(fd);
+		errno=EMFILE;
+		return -1;
+	}
+
+	node=&shim_nodes[fd];
+	memset(node, 0, sizeof(*node));
+	node->type=type;
+	node->config.buffer_size=type==NODE_PLAYBACK ? SHIM_PLAYBACK_BUFFER : SHIM_CAPTURE_BUFFER;
+	node->config.buffer_count=SHIM_BUFFERS;
+	node->config.channel_count=type==NODE_PLAYBACK ? 2 : 1;
+	node->config.sample_rate=type==NODE_PLAYBACK ? 44100 : 8000;
+
+	if(type!=NODE_CONTROL){
+		__sync_fetch_and_add(&shim_devices.pcm_opens, 1);
+		clock_gettime(CLOCK_MONOTONIC, &shim_devices.last_open);
+	}
+	return fd;
+}
+
+static int shim_open(const char *path, int flags, mode_t mode, uintptr_t caller)
+{
+	SHIM_REAL(open);
+
+	shim_count(SHIM_SYSCALL, caller);
+	shim_count(SHIM_OPEN, caller);
+	if(!strncmp(path, "/dev/msm_", 9))
+		return shim_open_node(path, flags);
+	return real_open(path, flags, mode);
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode=0;
+
+	if(flags & (O_CREAT | O_TMPFILE)){
+		va_start(ap, flags);
+		mode=va_arg(ap, int);
+		va_end(ap);
+	}
+	return shim_open(path, flags, mode, (uintptr_t)__builtin_return_address(0));
+}
+
+int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode=0;
+
+	if(flags & (O_CREAT | O_TMPFILE)){
+		va_start(ap, flags);
+		mode=va_arg(ap, int);
+		va_end(ap);
+	}
+	return shim_open(path, flags, mode, (uintptr_t)__builtin_return_address(0));
+}
+
+int close(int fd)
+{
+	SHIM_REAL(close);
+	struct shim_node *node=shim_node(fd);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	if(node)
+		node->type=NODE_NONE;
+	return real_close(fd);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	SHIM_REAL(write);
+	struct shim_node *node=shim_node(fd);
+	long long queued;
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	SHIM_COUNT(SHIM_WRITE);
+	if(!node)
+		return real_write(fd, buf, count);
+	if(node->type!=NODE_PLAYBACK){
+		errno=EINVAL;
+		return -1;
+	}
+
+	// Blocks while the device buffers are full
+	if(shim_realtime && node->started){
+		queued=(long long)node->bytes + count - shim_node_position(node);
+		shim_pace(node, queued - (long long)node->config.buffer_size * node->config.buffer_count);
+	}
+	node->bytes+=count;
+	__sync_fetch_and_add(&shim_devices.played_bytes, count);
+	return count;
+}
+
+// Whole canned frames in a loop, at the pace of the codec
+static ssize_t shim_read_encoder(struct shim_node *node, unsigned char *buf, size_t count)
+{
+	size_t i;
+
+	count-=count % shim_canned_frame;
+	if(!count){
+		errno=EINVAL;
+		return -1;
+	}
+	if(shim_realtime && node->started)
+		shim_pace(node, (long long)node->bytes + count - shim_node_position(node));
+
+	for(i=0; i<count; i++){
+		buf[i]=shim_canned[node->canned_pos++];
+		if(node->canned_pos==shim_canned_bytes)
+			node->canned_pos=0;
+	}
+	node->bytes+=count;
+	__sync_fetch_and_add(&shim_devices.captured_bytes, count);
+	return count;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	SHIM_REAL(read);
+	struct shim_node *node=shim_node(fd);
+	int16_t *out=buf;
+	size_t i;
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	SHIM_COUNT(SHIM_READ);
+	if(!node)
+		return real_read(fd, buf, count);
+	if(node->type==NODE_ENCODER)
+		return shim_read_encoder(node, buf, count);
+	if(node->type!=NODE_CAPTURE){
+		errno=EINVAL;
+		return -1;
+	}
+
+	// Blocks until the DSP recorded the frames
+	if(shim_realtime && node->started)
+		shim_pace(node, (long long)node->bytes + count - shim_node_position(node));
+
+	// A 100Hz square wave at 8KHz, not silence, so gates keep passing it
+	for(i=0; i<count / 2; i++, node->phase++)
+		out[i]=(node->phase / 40) & 1 ? 8000 : -8000;
+	node->bytes+=count;
+	__sync_fetch_and_add(&shim_devices.captured_bytes, count);
+	return count;
+}
+
+static int shim_node_ioctl(struct shim_node *node, unsigned long request, void *arg)
+{
+	struct msm_audio_stats *stats;
+	struct msm_snd_device_config *device;
+	struct msm_snd_endpoint *endpoint;
+	unsigned int i;
+
+	switch(request){
+		case AUDIO_GET_CONFIG:
+			memcpy(arg, &node->config, sizeof(node->config));
+			return 0;
+		case AUDIO_SET_CONFIG:
+			node->config.channel_count=((struct msm_audio_config *)arg)->channel_count;
+			node->config.sample_rate=((struct msm_audio_config *)arg)->sample_rate;
+			return 0;
+		case AUDIO_START:
+			if(!node->started){
+				clock_gettime(CLOCK_MONOTONIC, &node->start);
+				node->bytes=0;
+			}
+			node->started=1;
+			return 0;
+		case AUDIO_STOP:
+			node->started=0;
+			return 0;
+		case AUDIO_FLUSH:
+			return 0;
+		case AUDIO_GET_STATS:
+			stats=arg;
+			memset(stats, 0, sizeof(*stats));
+			stats->byte_count=shim_node_position(node);
+			if(stats->byte_count>node->bytes)
+				stats->byte_count=node->bytes;
+			return 0;
+		case SND_SET_DEVICE:
+			device=arg;
+			shim_devices.route=device->device;
+			shim_devices.ear_mute=device->ear_mute;
+			shim_devices.mic_mute=device->mic_mute;
+			__sync_fetch_and_add(&shim_devices.route_changes, 1);
+			return 0;
+		case SND_SET_VOLUME:
+			return 0;
+		case SND_GET_NUM_ENDPOINTS:
+			*(int *)arg=sizeof(shim_endpoints) / sizeof(shim_endpoints[0]);
+			return 0;
+		case SND_GET_ENDPOINT:
+			endpoint=arg;
+			for(i=0; i<sizeof(shim_endpoints) / sizeof(shim_endpoints[0]); i++){
+				if(shim_endpoints[i].id==endpoint->id){
+					*endpoint=shim_endpoints[i];
+					return 0;
+				}
+			}
+			break;
+	}
+	errno=EINVAL;
+	return -1;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	SHIM_REAL(ioctl);
+	struct shim_node *node=shim_node(fd);
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg=va_arg(ap, void *);
+	va_end(ap);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	SHIM_COUNT(SHIM_IOCTL);
+	if(node)
+		return shim_node_ioctl(node, request, arg);
+	return real_ioctl(fd, request, arg);
+}
+
+// The plugin checks the encoder node exists before using it
+int access(const char *path, int mode)
+{
+	SHIM_REAL(access);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	if(!strncmp(path, "/dev/msm_", 9)){
+		if(!strcmp(path, "/dev/msm_pcm_in") || !strcmp(path, "/dev/msm_pcm_out") ||
+		   !strcmp(path, "/dev/msm_snd") || shim_canned)
+			return 0;
+		errno=ENOENT;
+		return -1;
+	}
+	return real_access(path, mode);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	SHIM_REAL(poll);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_poll(fds, nfds, timeout);
+}
+
+int usleep(useconds_t usec)
+{
+	SHIM_REAL(usleep);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_usleep(usec);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	SHIM_REAL(nanosleep);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_nanosleep(req, rem);
+}
+
+long syscall(long number, ...)
+{
+	SHIM_REAL(syscall);
+	va_list ap;
+	long a[6];
+	int i;
+
+	va_start(ap, number);
+	for(i=0; i<6; i++)
+		a[i]=va_arg(ap, long);
+	va_end(ap);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+int timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value)
+{
+	SHIM_REAL(timerfd_settime);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_timerfd_settime(fd, flags, new_value, old_value);
+}
+
+int shmget(key_t key, size_t size, int shmflg)
+{
+	SHIM_REAL(shmget);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_shmget(key, size, shmflg);
+}
+
+void *shmat(int shmid, const void *shmaddr, int shmflg)
+{
+	SHIM_REAL(shmat);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_shmat(shmid, shmaddr, shmflg);
+}
+
+int kill(pid_t pid, int sig)
+{
+	SHIM_REAL(kill);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_kill(pid, sig);
+}
+
+pid_t getpid(void)
+{
+	SHIM_REAL(getpid);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_getpid();
+}
+
+int sched_yield(void)
+{
+	SHIM_REAL(sched_yield);
+
+	SHIM_COUNT(SHIM_SYSCALL);
+	return real_sched_yield();
+}
+
+void *malloc(size_t size)
+{
+	SHIM_COUNT(SHIM_MALLOC);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	SHIM_COUNT(SHIM_MALLOC);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	SHIM_COUNT(SHIM_MALLOC);
+	return __libc_realloc(ptr, size);
+}
+
+// The plugins are loaded by alsa-lib, their code ranges are taken on load
+void *dlopen(const char *filename, int flags)
+{
+	SHIM_REAL(dlopen);
+	void *handle=real_dlopen(filename, flags);
+
+	shim_update_ranges();
+	return handle;
+}
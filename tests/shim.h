@@ -0,0 +1,77 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHIM_H
+#define SHIM_H
+
+#include <time.h>
+
+/*
+ 	Test shim linked into the test programs and exported to the plugins
+ 	they load, so it takes the place of the libc functions the plugins
+ 	call. Opens of /dev/msm_* get stand-in nodes answering the MSM ioctls,
+ 	and the calls are counted, separately for the calls made from inside
+ 	the plugins.
+ */
+
+enum{
+	SHIM_SYSCALL,	// every wrapped function entering the kernel
+	SHIM_IOCTL,
+	SHIM_OPEN,
+	SHIM_WRITE,
+	SHIM_READ,
+	SHIM_MALLOC,	// malloc, calloc and realloc
+	SHIM_KINDS};
+
+struct shim_counts{
+	unsigned long plugin[SHIM_KINDS];	// called from the plugin modules
+	unsigned long total[SHIM_KINDS];
+};
+
+// What went through the stand-in nodes of this process
+struct shim_devices{
+	unsigned long pcm_opens;	// opens of playback and capture nodes
+	unsigned long played_bytes;	// written to playback nodes
+	unsigned long captured_bytes;	// read from capture nodes
+	unsigned long route_changes;	// SND_SET_DEVICE calls
+	int route;			// device of the last SND_SET_DEVICE, -1 before
+	int ear_mute;
+	int mic_mute;
+	struct timespec last_open;	// CLOCK_MONOTONIC time of the last pcm open
+};
+
+extern const char *shim_kind_names[SHIM_KINDS];
+
+/*
+ 	With realtime set, the stand-in nodes block like the DSP would: writes
+ 	and reads return at the pace of the configured rate once the device
+ 	buffers are full or empty. Otherwise they return at once.
+ */
+void shim_set_realtime(int realtime);
+/*
+ 	Once set, the other /dev/msm_*_in nodes exist and serve the canned
+ 	frames in a loop, one 20ms frame of frame_bytes at a time. The frames
+ 	must stay valid while they are used.
+ */
+void shim_set_encoder_frames(const unsigned char *frames, size_t bytes, unsigned int frame_bytes);
+void shim_reset(void);
+void shim_get_counts(struct shim_counts *counts);
+void shim_get_devices(struct shim_devices *devices);
+
+#endif
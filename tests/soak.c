@@ -0,0 +1,412 @@
+/*
+ * alsa-android - Alsa virtual driver that uses the MSM android sound driver
+ * 
+ * Copyright (C) Ahmed Abdel-Hamid 2010 <ahmedam@mail.usa.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ 	Soak test: worker processes keep opening, streaming and closing PCMs
+ 	against the stand-in nodes of the shim, paced at the stream rate, while
+ 	the main process flips the route and the volume through the control
+ 	plugin. Reports the tail of the open and route change latencies and
+ 	fails when they, the lost frames or the errors exceed their bounds.
+
+ 	soak [-w workers] [-d seconds] [-r route ms] [-o open ms] [-l lost frames]
+
+ 	Open latency is snd_pcm_open to a prepared PCM. Route change latency
+ 	runs from the route write to the first device open a streaming worker
+ 	does on the new route. Lost frames are played frames that never reached
+ 	a device, counted after the drain, and captured frames that were read
+ 	from a device but not delivered.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+#include "shim.h"
+
+#define SOAK_SAMPLES	65536
+#define SOAK_WORKERS_MAX	32
+#define SOAK_ROUTE_MS	250	// between route flips
+#define SOAK_VOLUME_MS	100	// between volume flips
+
+struct soak_series{
+	int count;
+	long long ns[SOAK_SAMPLES];
+};
+
+// Shared by the main process and the workers
+struct soak_stats{
+	int running;
+	int route_seq;			// bumped once a route write returned
+	long long route_change_ns;	// when the last route write began
+	struct soak_series open;
+	struct soak_series route;
+	long sessions;
+	long frames;
+	long lost_frames;
+	long xruns;
+	long errors;
+};
+
+struct soak_kind{
+	const char *pcm;
+	snd_pcm_stream_t stream;
+	unsigned int rate;
+	unsigned int channels;
+	snd_pcm_uframes_t period;
+	unsigned int periods;		// per buffer
+	unsigned int min_periods;	// streamed per session
+	unsigned int max_periods;
+};
+
+static const struct soak_kind kinds[] = {
+	{ "soak_playback", SND_PCM_STREAM_PLAYBACK, 44100, 2, 1200, 2, 10, 40 },
+	{ "soak_tsched", SND_PCM_STREAM_PLAYBACK, 48000, 2, 1200, 4, 10, 40 },
+	{ "soak_capture", SND_PCM_STREAM_CAPTURE, 8000, 2, 512, 2, 5, 20 },
+};
+
+static const char soak_definitions[] =
+	"pcm.soak_playback { type alsa_android }\n"
+	"pcm.soak_tsched { type alsa_android tsched yes }\n"
+	"pcm.soak_capture { type alsa_android }\n"
+	"ctl.soak { type alsa_android }\n";
+
+static struct soak_stats *stats;
+
+static void soak_add(struct soak_series *series, long long ns)
+{
+	int i=__sync_fetch_and_add(&series->count, 1);
+
+	if(i<SOAK_SAMPLES)
+		series->ns[i]=ns;
+}
+
+static int soak_open(snd_pcm_t **pcmp, const struct soak_kind *k, snd_config_t *conf)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_uframes_t period=k->period;
+	int ret;
+
+	ret=snd_pcm_open_lconf(pcmp, k->pcm, k->stream, 0, conf);
+	if(ret<0)
+		return ret;
+	ret=snd_pcm_hw_params_malloc(&params);
+	if(ret<0)
+		goto fail;
+	if((ret=snd_pcm_hw_params_any(*pcmp, params))<0 ||
+	   (ret=snd_pcm_hw_params_set_access(*pcmp, params, SND_PCM_ACCESS_RW_INTERLEAVED))<0 ||
+	   (ret=snd_pcm_hw_params_set_format(*pcmp, params, SND_PCM_FORMAT_S16_LE))<0 ||
+	   (ret=snd_pcm_hw_params_set_channels(*pcmp, params, k->channels))<0 ||
+	   (ret=snd_pcm_hw_params_set_rate(*pcmp, params, k->rate, 0))<0 ||
+	   (ret=snd_pcm_hw_params_set_period_size_near(*pcmp, params, &period, NULL))<0 ||
+	   (ret=snd_pcm_hw_params_set_periods(*pcmp, params, k->periods, 0))<0 ||
+	   (ret=snd_pcm_hw_params(*pcmp, params))<0){
+		snd_pcm_hw_params_free(params);
+		goto fail;
+	}
+	snd_pcm_hw_params_free(params);
+	ret=snd_pcm_prepare(*pcmp);
+	if(ret==0)
+		return 0;
+fail:
+	snd_pcm_close(*pcmp);
+	return ret;
+}
+
+// One open, stream and close cycle. Returns the frames lost, or an error
+static long soak_session(const struct soak_kind *k, snd_config_t *conf, int16_t *buf)
+{
+	struct shim_devices before, now;
+	snd_pcm_t *pcm;
+	snd_pcm_sframes_t ret;
+	unsigned long opens;
+	long long begin, moved, transferred=0;
+	unsigned int periods, i;
+	int seq, recovered=0;
+
+	periods=k->min_periods + rand() % (k->max_periods - k->min_periods + 1);
+
+	begin=harness_now_ns();
+	ret=soak_open(&pcm, k, conf);
+	if(ret<0){
+		fprintf(stderr, "%s: open: %s\n", k->pcm, snd_strerror(ret));
+		return ret;
+	}
+	soak_add(&stats->open, harness_now_ns() - begin);
+
+	shim_get_devices(&before);
+	opens=before.pcm_opens;
+	seq=stats->route_seq;
+	for(i=0; i<periods; i++){
+		snd_pcm_uframes_t done=0;
+
+		while(done<k->period){
+			if(k->stream==SND_PCM_STREAM_PLAYBACK)
+				ret=snd_pcm_writei(pcm, buf + done * k->channels, k->period - done);
+			else
+				ret=snd_pcm_readi(pcm, buf + done * k->channels, k->period - done);
+			if(ret==-EPIPE){
+				__sync_fetch_and_add(&stats->xruns, 1);
+				recovered=1;
+			}
+			if(ret<0)
+				ret=snd_pcm_recover(pcm, ret, 1);
+			if(ret<0){
+				fprintf(stderr, "%s: transfer: %s\n", k->pcm, snd_strerror(ret));
+				snd_pcm_close(pcm);
+				return ret;
+			}
+			done+=ret;
+		}
+		transferred+=done;
+
+		/*
+		 	A device opened again while streaming follows a route
+		 	change, unless an xrun stopped the stream. The first open
+		 	does not: the stream starts on the route it found.
+		 */
+		shim_get_devices(&now);
+		if(now.pcm_opens>opens){
+			if(opens>before.pcm_opens && stats->route_seq!=seq && !recovered)
+				soak_add(&stats->route, (now.last_open.tv_sec * 1000000000LL + now.last_open.tv_nsec) -
+				         stats->route_change_ns);
+			opens=now.pcm_opens;
+			seq=stats->route_seq;
+			recovered=0;
+		}
+	}
+
+	if(k->stream==SND_PCM_STREAM_PLAYBACK)
+		snd_pcm_drain(pcm);
+	snd_pcm_close(pcm);
+
+	// Played frames missing from the devices, or captured ones not delivered
+	shim_get_devices(&now);
+	__sync_fetch_and_add(&stats->sessions, 1);
+	__sync_fetch_and_add(&stats->frames, transferred);
+	if(k->stream==SND_PCM_STREAM_PLAYBACK){
+		moved=(now.played_bytes - before.played_bytes) / (k->channels * 2);
+		return moved<transferred ? transferred - moved : 0;
+	}
+	moved=(now.captured_bytes - before.captured_bytes) / (k->channels * 2);
+	return moved>transferred ? moved - transferred : 0;
+}
+
+static int soak_worker(int index, snd_config_t *conf)
+{
+	const struct soak_kind *k=&kinds[index % (sizeof(kinds) / sizeof(kinds[0]))];
+	int16_t *buf;
+	long lost;
+
+	srand(getpid());
+	buf=malloc(k->period * k->channels * sizeof(*buf));
+	if(!buf)
+		return 1;
+	harness_fill(buf, k->period, k->channels, k->rate);
+
+	while(__sync_fetch_and_add(&stats->running, 0)){
+		lost=soak_session(k, conf, buf);
+		if(lost<0)
+			__sync_fetch_and_add(&stats->errors, 1);
+		else
+			__sync_fetch_and_add(&stats->lost_frames, lost);
+	}
+	free(buf);
+	return 0;
+}
+
+static int soak_write(snd_ctl_t *ctl, snd_ctl_elem_value_t *value, const char *name, long v, int enumerated)
+{
+	snd_ctl_elem_value_set_interface(value, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_value_set_name(value, name);
+	if(enumerated)
+		snd_ctl_elem_value_set_enumerated(value, 0, v);
+	else
+		snd_ctl_elem_value_set_integer(value, 0, v);
+	return snd_ctl_elem_write(ctl, value);
+}
+
+// Flips the route and the volume until the deadline
+static int soak_control(snd_config_t *conf, long long deadline)
+{
+	snd_ctl_t *ctl;
+	snd_ctl_elem_value_t *value;
+	long long now, next_route, next_volume;
+	long route=0, volume=0;
+	int ret;
+
+	ret=snd_ctl_open_lconf(&ctl, "soak", 0, conf);
+	if(ret<0){
+		fprintf(stderr, "ctl open: %s\n", snd_strerror(ret));
+		return ret;
+	}
+	ret=snd_ctl_elem_value_malloc(&value);
+	if(ret<0){
+		snd_ctl_close(ctl);
+		return ret;
+	}
+
+	next_route=next_volume=harness_now_ns();
+	while((now=harness_now_ns())<deadline){
+		if(now>=next_route){
+			// The shim has 4 endpoints
+			route=(route + 1) % 4;
+			stats->route_change_ns=harness_now_ns();
+			ret=soak_write(ctl, value, "Playback Route", route, 1);
+			if(ret<0)
+				break;
+			__sync_fetch_and_add(&stats->route_seq, 1);
+			next_route+=SOAK_ROUTE_MS * 1000000LL;
+		}
+		if(now>=next_volume){
+			volume=(volume + 1) % 6;
+			ret=soak_write(ctl, value, "PCM Playback Volume", volume, 0);
+			if(ret<0)
+				break;
+			next_volume+=SOAK_VOLUME_MS * 1000000LL;
+		}
+		usleep(5000);
+	}
+	if(ret<0)
+		fprintf(stderr, "ctl write: %s\n", snd_strerror(ret));
+
+	snd_ctl_elem_value_free(value);
+	snd_ctl_close(ctl);
+	return ret<0 ? ret : 0;
+}
+
+static int soak_compare(const void *a, const void *b)
+{
+	long long x=*(const long long *)a, y=*(const long long *)b;
+
+	return x<y ? -1 : x>y;
+}
+
+// Prints the percentiles in ms, returns non zero if the p99 is above bound_ms
+static int soak_report(const char *name, struct soak_series *series, double bound_ms)
+{
+	int n=series->count<SOAK_SAMPLES ? series->count : SOAK_SAMPLES;
+	double p50, p90, p99, max;
+
+	if(!n){
+		printf("%-14s no samples\n", name);
+		return 0;
+	}
+	qsort(series->ns, n, sizeof(series->ns[0]), soak_compare);
+	p50=series->ns[(n - 1) * 50 / 100] / 1e6;
+	p90=series->ns[(n - 1) * 90 / 100] / 1e6;
+	p99=series->ns[(n - 1) * 99 / 100] / 1e6;
+	max=series->ns[n - 1] / 1e6;
+	printf("%-14s %6d samples  p50 %7.2fms  p90 %7.2fms  p99 %7.2fms  max %7.2fms  bound p99 %.0fms%s\n",
+	       name, n, p50, p90, p99, max, bound_ms, p99>bound_ms ? " EXCEEDED" : "");
+	return p99>bound_ms;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: soak [-w workers] [-d seconds] [-r route ms] [-o open ms] [-l lost frames]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	snd_config_t *conf;
+	pid_t pids[SOAK_WORKERS_MAX];
+	int workers=6, seconds=10, opt, i, status, ret, failed=0;
+	double route_ms=100, open_ms=50;
+	long lost_max=0;
+
+	while((opt=getopt(argc, argv, "w:d:r:o:l:"))!=-1){
+		switch(opt){
+			case 'w':
+				workers=atoi(optarg);
+				break;
+			case 'd':
+				seconds=atoi(optarg);
+				break;
+			case 'r':
+				route_ms=atof(optarg);
+				break;
+			case 'o':
+				open_ms=atof(optarg);
+				break;
+			case 'l':
+				lost_max=atol(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if(workers<1 || workers>SOAK_WORKERS_MAX || seconds<1)
+		usage();
+
+	stats=mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(stats==MAP_FAILED)
+		return 1;
+	stats->running=1;
+	shim_set_realtime(1);
+
+	ret=harness_config(soak_definitions, &conf);
+	if(ret<0){
+		fprintf(stderr, "config: %s\n", snd_strerror(ret));
+		return 1;
+	}
+
+	// Forked before the control starts its threads
+	for(i=0; i<workers; i++){
+		pids[i]=fork();
+		if(pids[i]==0)
+			_exit(soak_worker(i, conf));
+		if(pids[i]<0){
+			perror("fork");
+			workers=i;
+			failed=1;
+			break;
+		}
+	}
+
+	if(!failed && soak_control(conf, harness_now_ns() + seconds * 1000000000LL))
+		failed=1;
+
+	__sync_lock_test_and_set(&stats->running, 0);
+	for(i=0; i<workers; i++){
+		if(waitpid(pids[i], &status, 0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)){
+			fprintf(stderr, "worker %d did not exit cleanly\n", i);
+			failed=1;
+		}
+	}
+
+	printf("soak: %d workers for %ds, %ld sessions, %ld frames, %ld xruns, %d route changes\n",
+	       workers, seconds, stats->sessions, stats->frames, stats->xruns, stats->route_seq);
+	failed|=soak_report("open", &stats->open, open_ms);
+	failed|=soak_report("route change", &stats->route, route_ms);
+	printf("lost frames    %ld, bound %ld%s\n", stats->lost_frames, lost_max,
+	       stats->lost_frames>lost_max ? " EXCEEDED" : "");
+	printf("errors         %ld\n", stats->errors);
+	if(stats->lost_frames>lost_max || stats->errors)
+		failed=1;
+
+	snd_config_delete(conf);
+	return failed;
+}
@@ -0,0 +1,7 @@
+#!/bin/sh
+# Opens, streams and route changes from concurrent processes. The p99 of
+# the route change latency is bounded by a few periods of the slowest
+# stream, 64ms for the capture, and nothing may be lost. Extra flags,
+# like -d 600 for a long run, can be passed in SOAK_FLAGS.
+
+exec ./soak -w 6 -d 10 -r 150 -o 50 -l 0 $SOAK_FLAGS